@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bitmap.h>
+#include <linux/mm.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+#include "ouichefs.h"
+
+/*
+ * The free inodes and free blocks bitmaps are not copied in memory. The
+ * allocator works directly on the buffer heads of the on-disk bitmap blocks.
+ * A bitmap block is only read the first time it is needed, and is then kept
+ * pinned in the buffer cache. Changing a bit dirties the buffer holding it, so
+ * sync_fs only has to write the dirty buffers back. Under memory pressure, the
+ * shrinker unpins the clean blocks; they are read again on their next use.
+ *
+ * For each block, we also remember whether it is known to hold no free bit, so
+ * that searching for a free bit does not load blocks that are full.
+ *
+ * The free runs summary of the superblock is refreshed from the free blocks
+ * bitmap blocks as they are written back, and gives the allocator a goal.
+ *
+ * Unless stated otherwise, the functions below expect the bitmap_lock of the
+ * superblock to be held.
+ */
+
+/* Number of bitmap blocks read ahead when a block has to be loaded */
+#define OUICHEFS_BITMAP_RA 8
+
+/*
+ * Return the buffer of the blk-th block of bm, reading it from disk if it is
+ * not loaded yet, or NULL on I/O error.
+ */
+static struct buffer_head *bitmap_block(struct ouichefs_bitmap *bm,
+					unsigned long blk)
+{
+	struct buffer_head *bh = bm->bh[blk];
+
+	if (bh)
+		return bh;
+
+	/* Searches go forward, so are likely to need the next blocks too */
+	ouichefs_readahead_blocks(bm->sb, bm->first + blk,
+				  min_t(unsigned long, OUICHEFS_BITMAP_RA,
+					bm->nr_blocks - blk));
+	bh = sb_bread_unmovable(bm->sb, bm->first + blk);
+	if (!bh) {
+		pr_err("unable to read bitmap block %lu\n", bm->first + blk);
+		return NULL;
+	}
+	bm->bh[blk] = bh;
+	bm->nr_loaded++;
+
+	return bh;
+}
+
+/*
+ * Return the first bit in [start, end) of bm that is set (if set is true) or
+ * clear (otherwise), or a value >= end if there is none. Blocks that cannot be
+ * read are skipped.
+ */
+unsigned long ouichefs_bitmap_find(struct ouichefs_bitmap *bm,
+				   unsigned long start, unsigned long end,
+				   bool set)
+{
+	struct buffer_head *bh;
+	unsigned long blk, off, len, bit;
+
+	end = min(end, bm->nr_bits);
+	while (start < end) {
+		blk = start / OUICHEFS_BITS_PER_BLOCK;
+		off = start % OUICHEFS_BITS_PER_BLOCK;
+		len = min_t(unsigned long, OUICHEFS_BITS_PER_BLOCK,
+			    end - blk * OUICHEFS_BITS_PER_BLOCK);
+
+		/* A full block has no bit set, and all of them clear */
+		if (test_bit(blk, bm->full)) {
+			if (!set)
+				return start;
+			goto next;
+		}
+
+		bh = bitmap_block(bm, blk);
+		if (!bh)
+			goto next;
+
+		if (set)
+			bit = find_next_bit((unsigned long *)bh->b_data, len,
+					    off);
+		else
+			bit = find_next_zero_bit((unsigned long *)bh->b_data,
+						 len, off);
+		if (bit < len)
+			return blk * OUICHEFS_BITS_PER_BLOCK + bit;
+
+		/* We looked at the whole block without finding a free bit */
+		if (set && !off &&
+		    len == min_t(unsigned long, OUICHEFS_BITS_PER_BLOCK,
+				 bm->nr_bits - blk * OUICHEFS_BITS_PER_BLOCK))
+			set_bit(blk, bm->full);
+next:
+		start = (blk + 1) * OUICHEFS_BITS_PER_BLOCK;
+	}
+
+	return end;
+}
+
+/* Return the number of bits set in [start, end) of data */
+static unsigned long count_set_bits(unsigned long *data, unsigned long start,
+				    unsigned long end)
+{
+	unsigned long first, last, count = 0;
+
+	first = find_next_bit(data, end, start);
+	while (first < end) {
+		last = find_next_zero_bit(data, end, first);
+		count += last - first;
+		first = find_next_bit(data, end, last);
+	}
+
+	return count;
+}
+
+/*
+ * Set (if set is true) or clear count bits of bm starting at start, and mark
+ * the buffers holding them dirty.
+ * Return the number of bits that changed, or -EIO if a bitmap block could not
+ * be read.
+ */
+long ouichefs_bitmap_assign(struct ouichefs_bitmap *bm, unsigned long start,
+			    unsigned long count, bool set)
+{
+	struct buffer_head *bh;
+	unsigned long blk, off, len, nr_set;
+	long changed = 0;
+
+	while (count) {
+		blk = start / OUICHEFS_BITS_PER_BLOCK;
+		off = start % OUICHEFS_BITS_PER_BLOCK;
+		len = min(count, OUICHEFS_BITS_PER_BLOCK - off);
+
+		bh = bitmap_block(bm, blk);
+		if (!bh)
+			return -EIO;
+
+		nr_set = count_set_bits((unsigned long *)bh->b_data, off,
+					off + len);
+		if (set) {
+			bitmap_set((unsigned long *)bh->b_data, off, len);
+			clear_bit(blk, bm->full);
+			changed += len - nr_set;
+		} else {
+			bitmap_clear((unsigned long *)bh->b_data, off, len);
+			changed += nr_set;
+		}
+		mark_buffer_dirty(bh);
+
+		start += len;
+		count -= len;
+	}
+
+	return changed;
+}
+
+/*
+ * Record the free run [start, start + len) in the free runs summary if it is
+ * larger than the smallest run in there.
+ */
+static void summary_insert(struct ouichefs_sb_info *sbi, uint32_t start,
+			   uint32_t len)
+{
+	struct ouichefs_free_run *min = &sbi->free_runs[0];
+	int i;
+
+	for (i = 1; i < OUICHEFS_SUMMARY_RUNS; i++) {
+		if (sbi->free_runs[i].len < min->len)
+			min = &sbi->free_runs[i];
+	}
+	if (len > min->len) {
+		min->start = start;
+		min->len = len;
+	}
+}
+
+/*
+ * Replace the runs of the free runs summary that start in the blk-th block of
+ * the free blocks bitmap by the largest free runs of this block. Runs crossing
+ * the boundary between two bitmap blocks are accounted as two runs.
+ */
+void ouichefs_summary_refresh(struct ouichefs_sb_info *sbi, unsigned long blk)
+{
+	struct ouichefs_bitmap *bm = &sbi->bfree_bitmap;
+	struct buffer_head *bh;
+	unsigned long base, len, first, last;
+	unsigned long *data;
+	int i;
+
+	bh = bitmap_block(bm, blk);
+	if (!bh)
+		return;
+	data = (unsigned long *)bh->b_data;
+	base = blk * OUICHEFS_BITS_PER_BLOCK;
+	len = min_t(unsigned long, OUICHEFS_BITS_PER_BLOCK,
+		    bm->nr_bits - base);
+
+	for (i = 0; i < OUICHEFS_SUMMARY_RUNS; i++) {
+		if (sbi->free_runs[i].start >= base &&
+		    sbi->free_runs[i].start < base + len)
+			sbi->free_runs[i].len = 0;
+	}
+
+	first = find_next_bit(data, len, 0);
+	if (first >= len)
+		set_bit(blk, bm->full);
+	while (first < len) {
+		last = find_next_zero_bit(data, len, first);
+		summary_insert(sbi, base + first, last - first);
+		first = find_next_bit(data, len, last);
+	}
+}
+
+/*
+ * Return the block from which to look for a free block: the start of the
+ * largest known free run, or 0 if we do not know any.
+ */
+uint32_t ouichefs_summary_goal(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_free_run *best = &sbi->free_runs[0];
+	int i;
+
+	for (i = 1; i < OUICHEFS_SUMMARY_RUNS; i++) {
+		if (sbi->free_runs[i].len > best->len)
+			best = &sbi->free_runs[i];
+	}
+
+	return best->len ? best->start : 0;
+}
+
+/*
+ * Remove a newly allocated block from the free runs summary. If it is not the
+ * first block of its run, the run is cut short at bno.
+ */
+void ouichefs_summary_consume(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	struct ouichefs_free_run *run;
+	int i;
+
+	for (i = 0; i < OUICHEFS_SUMMARY_RUNS; i++) {
+		run = &sbi->free_runs[i];
+		if (!run->len || bno < run->start || bno >= run->start + run->len)
+			continue;
+
+		if (bno == run->start) {
+			run->start++;
+			run->len--;
+		} else {
+			run->len = bno - run->start;
+		}
+	}
+}
+
+/*
+ * Rebuild the free runs summary from the whole free blocks bitmap, when it was
+ * not written back at unmount. The bitmap lock is taken here, for one block at
+ * a time, so that allocations can go on meanwhile.
+ */
+void ouichefs_summary_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, summary_work);
+	unsigned long blk;
+
+	for (blk = 0; blk < sbi->bfree_bitmap.nr_blocks; blk++) {
+		if (READ_ONCE(sbi->summary_stop))
+			break;
+
+		mutex_lock(&sbi->bitmap_lock);
+		ouichefs_summary_refresh(sbi, blk);
+		mutex_unlock(&sbi->bitmap_lock);
+
+		cond_resched();
+	}
+	if (blk == sbi->bfree_bitmap.nr_blocks)
+		sbi->summary_valid = true;
+}
+
+/*
+ * Unpin up to nr_to_scan clean blocks of bm. Return the number of blocks
+ * unpinned.
+ */
+static unsigned long bitmap_shrink(struct ouichefs_bitmap *bm,
+				   unsigned long nr_to_scan)
+{
+	unsigned long freed = 0;
+	uint32_t i;
+
+	for (i = 0; i < bm->nr_blocks && freed < nr_to_scan; i++) {
+		struct buffer_head *bh = bm->bh[i];
+
+		if (!bh || buffer_dirty(bh))
+			continue;
+
+		brelse(bh);
+		bm->bh[i] = NULL;
+		bm->nr_loaded--;
+		freed++;
+	}
+
+	return freed;
+}
+
+static unsigned long ouichefs_bitmap_count(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, bitmap_shrinker);
+
+	return READ_ONCE(sbi->ifree_bitmap.nr_loaded) +
+	       READ_ONCE(sbi->bfree_bitmap.nr_loaded);
+}
+
+static unsigned long ouichefs_bitmap_scan(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, bitmap_shrinker);
+	unsigned long freed;
+
+	/* The allocator may be the one reclaiming memory */
+	if (!mutex_trylock(&sbi->bitmap_lock))
+		return SHRINK_STOP;
+	freed = bitmap_shrink(&sbi->bfree_bitmap, sc->nr_to_scan);
+	if (freed < sc->nr_to_scan)
+		freed += bitmap_shrink(&sbi->ifree_bitmap,
+				       sc->nr_to_scan - freed);
+	mutex_unlock(&sbi->bitmap_lock);
+
+	return freed;
+}
+
+/*
+ * Set up an on-disk bitmap of nr_bits bits stored in nr_blocks blocks starting
+ * at block first. No block is read here.
+ */
+int ouichefs_init_bitmap(struct super_block *sb, struct ouichefs_bitmap *bm,
+			 uint32_t first, uint32_t nr_blocks,
+			 unsigned long nr_bits)
+{
+	if (!nr_blocks || nr_bits > (unsigned long)nr_blocks *
+					   OUICHEFS_BITS_PER_BLOCK) {
+		pr_err("bitmap at block %u too small for %lu bits\n", first,
+		       nr_bits);
+		return -EINVAL;
+	}
+
+	bm->sb = sb;
+	bm->first = first;
+	bm->nr_blocks = nr_blocks;
+	bm->nr_bits = nr_bits;
+	bm->nr_loaded = 0;
+	bm->busy_start = bm->busy_end = 0;
+	bm->bh = kvcalloc(nr_blocks, sizeof(*bm->bh), GFP_KERNEL);
+	bm->full = kvcalloc(BITS_TO_LONGS(nr_blocks), sizeof(unsigned long),
+			    GFP_KERNEL);
+	if (!bm->bh || !bm->full) {
+		ouichefs_release_bitmap(bm);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void ouichefs_release_bitmap(struct ouichefs_bitmap *bm)
+{
+	uint32_t i;
+
+	if (bm->bh) {
+		for (i = 0; i < bm->nr_blocks; i++)
+			brelse(bm->bh[i]);
+	}
+	kvfree(bm->bh);
+	kvfree(bm->full);
+	bm->bh = NULL;
+	bm->full = NULL;
+	bm->nr_loaded = 0;
+}
+
+int ouichefs_register_bitmap_shrinker(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	sbi->bitmap_shrinker.count_objects = ouichefs_bitmap_count;
+	sbi->bitmap_shrinker.scan_objects = ouichefs_bitmap_scan;
+	sbi->bitmap_shrinker.seeks = DEFAULT_SEEKS;
+
+	return register_shrinker(&sbi->bitmap_shrinker, "ouichefs-bitmap:%s",
+				 sb->s_id);
+}
+
+void ouichefs_unregister_bitmap_shrinker(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	unregister_shrinker(&sbi->bitmap_shrinker);
+}
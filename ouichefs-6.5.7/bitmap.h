@@ -8,40 +8,93 @@
 #define _OUICHEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/mutex.h>
 #include "ouichefs.h"
 
 /*
- * Return the first free bit (set to 1) in a given in-memory bitmap spanning
- * over multiple blocks and clear it.
+ * All the functions below expect the bitmap_lock of the superblock to be held,
+ * except for the get_free_* and put_* helpers that take it themselves.
+ */
+
+/*
+ * Return the first free bit (set to 1) of bm in [start, end) that is not busy,
+ * or end if there is none.
+ */
+static inline unsigned long find_free_bit(struct ouichefs_bitmap *bm,
+					  unsigned long start, unsigned long end)
+{
+	unsigned long bit = ouichefs_bitmap_find(bm, start, end, true);
+
+	if (bit >= bm->busy_start && bit < bm->busy_end)
+		bit = ouichefs_bitmap_find(bm, bm->busy_end, end, true);
+
+	return bit;
+}
+
+/*
+ * Return the first free bit (set to 1) at or after goal in a given bitmap,
+ * wrapping around to the beginning of the bitmap if needed, and clear it.
  * Return 0 if no free bit found (we assume that the first bit is never free
  * because of the superblock and the root inode, thus allowing us to use 0 as an
  * error value).
  */
-static inline uint32_t get_first_free_bit(unsigned long *freemap,
-					  unsigned long size)
+static inline uint32_t get_next_free_bit(struct ouichefs_bitmap *bm,
+					 unsigned long goal)
 {
-	uint32_t ino;
+	unsigned long bit;
+
+	if (goal >= bm->nr_bits)
+		goal = 0;
 
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
-		return 0;
+	bit = find_free_bit(bm, goal, bm->nr_bits);
+	if (bit >= bm->nr_bits) {
+		bit = find_free_bit(bm, 0, goal);
+		if (bit >= goal)
+			return 0;
+	}
 
-	bitmap_clear(freemap, ino, 1);
+	ouichefs_bitmap_assign(bm, bit, 1, false);
 
-	return ino;
+	return bit;
 }
 
 /*
- * Return an unused inode number and mark it used.
+ * Return the number of free bits (set to 1) in [start, start + len) of a given
+ * bitmap.
+ */
+static inline uint32_t count_free_bits(struct ouichefs_bitmap *bm,
+				       unsigned long start, unsigned long len)
+{
+	unsigned long end = min(start + len, bm->nr_bits);
+	unsigned long first, last;
+	uint32_t count = 0;
+
+	first = ouichefs_bitmap_find(bm, start, end, true);
+	while (first < end) {
+		last = ouichefs_bitmap_find(bm, first, end, false);
+		count += last - first;
+		first = ouichefs_bitmap_find(bm, last, end, true);
+	}
+
+	return count;
+}
+
+/*
+ * Return an unused inode number, as close as possible after goal, and mark it
+ * used.
  * Return 0 if no free inode was found.
  */
-static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
 	uint32_t ret;
 
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
-	if (ret) {
+	mutex_lock(&sbi->bitmap_lock);
+	ret = get_next_free_bit(&sbi->ifree_bitmap, goal);
+	if (ret)
 		sbi->nr_free_inodes--;
+	mutex_unlock(&sbi->bitmap_lock);
+	if (ret) {
 		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
 			 ret);
 	}
@@ -49,16 +102,22 @@ static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
 }
 
 /*
- * Return an unused block number and mark it used.
+ * Return an unused block number and mark it used. We first look in the largest
+ * known free run, so that files get contiguous blocks.
  * Return 0 if no free block was found.
  */
 static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
 {
 	uint32_t ret;
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
+	mutex_lock(&sbi->bitmap_lock);
+	ret = get_next_free_bit(&sbi->bfree_bitmap, ouichefs_summary_goal(sbi));
 	if (ret) {
 		sbi->nr_free_blocks--;
+		ouichefs_summary_consume(sbi, ret);
+	}
+	mutex_unlock(&sbi->bitmap_lock);
+	if (ret) {
 		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
 			 ret);
 	}
@@ -66,18 +125,16 @@ static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
 }
 
 /*
- * Mark the i-th bit in freemap as free (i.e. 1)
+ * Mark the i-th bit in bm as free (i.e. 1)
+ * Return 1, 0 if it already was free, or a negative value on error.
  */
-static inline int put_free_bit(unsigned long *freemap, unsigned long size,
-			       uint32_t i)
+static inline long put_free_bit(struct ouichefs_bitmap *bm, uint32_t i)
 {
-	/* i is greater than freemap size */
-	if (i > size)
+	/* i is greater than bitmap size */
+	if (i >= bm->nr_bits)
 		return -1;
 
-	bitmap_set(freemap, i, 1);
-
-	return 0;
+	return ouichefs_bitmap_assign(bm, i, 1, true);
 }
 
 /*
@@ -85,10 +142,18 @@ static inline int put_free_bit(unsigned long *freemap, unsigned long size,
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
-		return;
+	long ret;
 
+	mutex_lock(&sbi->bitmap_lock);
+	ret = put_free_bit(&sbi->ifree_bitmap, ino);
+	if (ret <= 0) {
+		mutex_unlock(&sbi->bitmap_lock);
+		WARN_ONCE(!ret, "inode %u already free\n", ino);
+		return;
+	}
 	sbi->nr_free_inodes++;
+	mutex_unlock(&sbi->bitmap_lock);
+
 	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
 }
 
@@ -97,11 +162,48 @@ static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
-		return;
+	long ret;
 
+	mutex_lock(&sbi->bitmap_lock);
+	ret = put_free_bit(&sbi->bfree_bitmap, bno);
+	if (ret <= 0) {
+		mutex_unlock(&sbi->bitmap_lock);
+		WARN_ONCE(!ret, "block %u already free\n", bno);
+		return;
+	}
 	sbi->nr_free_blocks++;
+	mutex_unlock(&sbi->bitmap_lock);
+
 	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
 }
 
+/*
+ * Mark count contiguous blocks, starting at bno, as unused. Only the blocks
+ * that were in use are accounted.
+ */
+static inline void put_blocks(struct ouichefs_sb_info *sbi, uint32_t bno,
+			      uint32_t count)
+{
+	long ret;
+
+	/* range goes beyond the end of the bitmap */
+	if (bno + count > sbi->nr_blocks)
+		return;
+
+	mutex_lock(&sbi->bitmap_lock);
+	ret = ouichefs_bitmap_assign(&sbi->bfree_bitmap, bno, count, true);
+	if (ret < 0) {
+		mutex_unlock(&sbi->bitmap_lock);
+		return;
+	}
+	sbi->nr_free_blocks += ret;
+	mutex_unlock(&sbi->bitmap_lock);
+
+	WARN_ONCE(ret != count, "%ld of blocks %u-%u already free\n",
+		  count - ret, bno, bno + count - 1);
+
+	pr_debug("%s:%d: freed blocks %u-%u\n", __func__, __LINE__, bno,
+		 bno + count - 1);
+}
+
 #endif /* _OUICHEFS_BITMAP_H */
@@ -10,28 +10,1051 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Without the hashed directories feature, a directory is a struct
+ * ouichefs_dir_block whose entries are packed at the beginning of the block,
+ * unless it is sparse. Otherwise, it is a leaf of struct ouichefs_dirent
+ * records, or with the large directories feature, a dx block listing such
+ * leaves once the first one is full. The functions below hide the difference
+ * from the inode operations, and keep the in-memory name index of dir (see
+ * namecache.c) in sync with the disk. They expect dir to be locked.
+ */
+static inline bool ouichefs_dir_hashed(struct inode *dir)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+
+	return sbi->features & OUICHEFS_FEATURE_HASHED_DIRS;
+}
+
+/* Free entries of a legacy directory block may be anywhere */
+static inline bool ouichefs_dir_sparse(struct inode *dir)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+
+	return sbi->features & OUICHEFS_FEATURE_SPARSE_DIRS;
+}
+
+static inline bool ouichefs_name_match(const char *filename,
+				       const struct qstr *name)
+{
+	return !strncmp(filename, name->name, OUICHEFS_FILENAME_LEN);
+}
+
+/*
+ * Return the record at offset off of leaf, or NULL if it does not fit in the
+ * block, if its name does not fit in it or if a used record has an empty name.
+ */
+static struct ouichefs_dirent *ouichefs_dirent_at(char *leaf, unsigned int off)
+{
+	struct ouichefs_dirent *de = (struct ouichefs_dirent *)(leaf + off);
+
+	if (off > OUICHEFS_BLOCK_SIZE - OUICHEFS_DIRENT_LEN(0) ||
+	    de->rec_len < OUICHEFS_DIRENT_LEN(0) || de->rec_len % 4 ||
+	    de->rec_len > OUICHEFS_BLOCK_SIZE - off ||
+	    (de->inode && (!de->name_len ||
+			   OUICHEFS_DIRENT_LEN(de->name_len) > de->rec_len))) {
+		pr_err("Corrupted directory record at offset %u\n", off);
+		return NULL;
+	}
+
+	return de;
+}
+
+/* Make leaf a single free record */
+static void ouichefs_leaf_init(char *leaf)
+{
+	struct ouichefs_dirent *de = (struct ouichefs_dirent *)leaf;
+
+	memset(leaf, 0, OUICHEFS_BLOCK_SIZE);
+	de->rec_len = OUICHEFS_BLOCK_SIZE;
+}
+
+/*
+ * Return the record of name in leaf, NULL if there is none or an ERR_PTR if
+ * the leaf is corrupted. Only the names of records with the same hash are
+ * compared.
+ */
+static struct ouichefs_dirent *
+ouichefs_leaf_lookup(char *leaf, uint32_t hash, const struct qstr *name)
+{
+	struct ouichefs_dirent *de;
+	unsigned int off;
+
+	for (off = 0; off < OUICHEFS_BLOCK_SIZE; off += de->rec_len) {
+		de = ouichefs_dirent_at(leaf, off);
+		if (!de)
+			return ERR_PTR(-EIO);
+		if (de->inode && de->hash == hash &&
+		    de->name_len == name->len &&
+		    !memcmp(de->name, name->name, name->len))
+			return de;
+	}
+
+	return NULL;
+}
+
+/*
+ * Find room for a record with a name of len bytes in leaf, splitting the end
+ * of a used record off if needed. Removed records are only cleared, they are
+ * merged into the record before them here. Return the record, NULL if the
+ * leaf is full or an ERR_PTR if it is corrupted.
+ */
+static struct ouichefs_dirent *ouichefs_leaf_alloc(char *leaf,
+						   unsigned int len)
+{
+	unsigned int off, used, need = OUICHEFS_DIRENT_LEN(len);
+	struct ouichefs_dirent *de, *next;
+
+	for (off = 0; off < OUICHEFS_BLOCK_SIZE; off += de->rec_len) {
+		de = ouichefs_dirent_at(leaf, off);
+		if (!de)
+			return ERR_PTR(-EIO);
+		while (off + de->rec_len < OUICHEFS_BLOCK_SIZE) {
+			next = ouichefs_dirent_at(leaf, off + de->rec_len);
+			if (!next)
+				return ERR_PTR(-EIO);
+			if (next->inode)
+				break;
+			de->rec_len += next->rec_len;
+		}
+		used = de->inode ? OUICHEFS_DIRENT_LEN(de->name_len) : 0;
+		if (de->rec_len - used < need)
+			continue;
+		if (used) {
+			next = (struct ouichefs_dirent *)((char *)de + used);
+			next->rec_len = de->rec_len - used;
+			de->rec_len = used;
+			de = next;
+		}
+		return de;
+	}
+
+	return NULL;
+}
+
+static void ouichefs_dirent_set(struct ouichefs_dirent *de, uint32_t ino,
+				uint32_t hash, const char *name,
+				unsigned int len, uint8_t file_type)
+{
+	de->inode = ino;
+	de->hash = hash;
+	de->name_len = len;
+	de->file_type = file_type;
+	memcpy(de->name, name, len);
+}
+
+/*
+ * Return the index of the leaf of dx that holds hash, i.e. the last leaf whose
+ * lowest hash is not above it.
+ */
+static uint32_t ouichefs_dx_search(struct ouichefs_dx_block *dx, uint32_t hash)
+{
+	uint32_t lo = 0, hi = dx->nr_leaves - 1, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (dx->leaves[mid].hash <= hash)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/*
+ * Read the dx block of the indexed directory dir. Return its buffer, or
+ * ERR_PTR(-EIO) if it cannot be read or if it lists no leaf or more leaves than
+ * it has room for.
+ */
+static struct buffer_head *ouichefs_dx_read(struct inode *dir)
+{
+	struct ouichefs_dx_block *dx;
+	struct buffer_head *bh;
+
+	bh = sb_bread(dir->i_sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	dx = (struct ouichefs_dx_block *)bh->b_data;
+	if (!dx->nr_leaves || dx->nr_leaves > OUICHEFS_DX_LEAVES) {
+		pr_err("Corrupted dx block of directory %lu\n", dir->i_ino);
+		brelse(bh);
+		return ERR_PTR(-EIO);
+	}
+
+	return bh;
+}
+
+/*
+ * Return the block of the leaf of the hashed directory dir that holds hash, or
+ * 0 if the dx block cannot be read.
+ */
+static uint32_t ouichefs_hdir_leaf(struct inode *dir, uint32_t hash)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dx_block *dx;
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	if (!(ci->i_flags & OUICHEFS_INODE_INDEXED))
+		return ci->index_block;
+
+	bh = ouichefs_dx_read(dir);
+	if (IS_ERR(bh))
+		return 0;
+	dx = (struct ouichefs_dx_block *)bh->b_data;
+	bno = dx->leaves[ouichefs_dx_search(dx, hash)].block;
+	brelse(bh);
+
+	return bno;
+}
+
+/*
+ * Allocate a block for dir and return a zeroed buffer for it. The caller marks
+ * it dirty once filled.
+ */
+static struct buffer_head *ouichefs_dir_new_block(struct inode *dir,
+						  uint32_t *bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct buffer_head *bh;
+
+	*bno = get_free_block(sbi);
+	if (!*bno)
+		return ERR_PTR(-ENOSPC);
+
+	/* The block is fully written, do not read it */
+	bh = sb_getblk(dir->i_sb, *bno);
+	if (!bh) {
+		put_block(sbi, *bno);
+		return ERR_PTR(-EIO);
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+
+	dir->i_blocks++;
+	dir->i_size += OUICHEFS_BLOCK_SIZE;
+	mark_inode_dirty(dir);
+
+	return bh;
+}
+
+/*
+ * Turn the hashed directory dir into an indexed one, whose dx block lists its
+ * current block as the only leaf.
+ */
+static int ouichefs_dx_create(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dx_block *dx;
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	bh = ouichefs_dir_new_block(dir, &bno);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	dx = (struct ouichefs_dx_block *)bh->b_data;
+	dx->nr_leaves = 1;
+	dx->leaves[0].hash = 0;
+	dx->leaves[0].block = ci->index_block;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	ci->index_block = bno;
+	ci->i_flags |= OUICHEFS_INODE_INDEXED;
+	mark_inode_dirty(dir);
+
+	return 0;
+}
+
+/* Order records by hash, and records with the same hash by name */
+static int cmp_dirent_hash(const void *a, const void *b)
+{
+	const struct ouichefs_dirent *da = *(const struct ouichefs_dirent **)a;
+	const struct ouichefs_dirent *db = *(const struct ouichefs_dirent **)b;
+	int ret;
+
+	if (da->hash != db->hash)
+		return da->hash < db->hash ? -1 : 1;
+	ret = memcmp(da->name, db->name, min(da->name_len, db->name_len));
+	if (ret)
+		return ret;
+
+	return da->name_len - db->name_len;
+}
+
+/*
+ * Collect the used records of leaf whose hash is at least start in ents, that
+ * has room for OUICHEFS_DIRENT_MAX records, sorted by hash and name. Return
+ * their number, or -EIO if the leaf is corrupted.
+ */
+static int ouichefs_leaf_sort(char *leaf, uint64_t start,
+			      struct ouichefs_dirent **ents)
+{
+	struct ouichefs_dirent *de;
+	unsigned int off;
+	int n = 0;
+
+	for (off = 0; off < OUICHEFS_BLOCK_SIZE; off += de->rec_len) {
+		de = ouichefs_dirent_at(leaf, off);
+		if (!de)
+			return -EIO;
+		if (!de->inode || de->hash < start)
+			continue;
+		if (n == OUICHEFS_DIRENT_MAX) {
+			pr_err("Too many records in directory leaf\n");
+			return -EIO;
+		}
+		ents[n++] = de;
+	}
+	sort(ents, n, sizeof(*ents), cmp_dirent_hash, NULL);
+
+	return n;
+}
+
+/*
+ * Split the full leaf of dir that holds hash: the records of the upper half of
+ * its hashes, by room used, move to a new leaf listed right after it in the dx
+ * block. Both leaves are packed again. The first split turns dir into an
+ * indexed directory. Return -EMLINK if the dx block is full, or if all the
+ * records of the leaf have the same hash.
+ */
+static int ouichefs_dx_split(struct inode *dir, uint32_t hash)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh_dx, *bh_old, *bh_new;
+	struct ouichefs_dirent **ents, *de;
+	struct ouichefs_dx_block *dx;
+	uint32_t split, new_bno, i;
+	unsigned int used, total;
+	int j, k, n, ret = 0;
+	char *copy;
+
+	if (!(ci->i_flags & OUICHEFS_INODE_INDEXED)) {
+		ret = ouichefs_dx_create(dir);
+		if (ret)
+			return ret;
+	}
+
+	copy = kmalloc(OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+	ents = kmalloc_array(OUICHEFS_DIRENT_MAX, sizeof(*ents), GFP_KERNEL);
+	if (!copy || !ents) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	bh_dx = ouichefs_dx_read(dir);
+	if (IS_ERR(bh_dx)) {
+		ret = PTR_ERR(bh_dx);
+		goto free;
+	}
+	dx = (struct ouichefs_dx_block *)bh_dx->b_data;
+	if (dx->nr_leaves == OUICHEFS_DX_LEAVES) {
+		ret = -EMLINK;
+		goto release_dx;
+	}
+	i = ouichefs_dx_search(dx, hash);
+
+	bh_old = sb_bread(sb, dx->leaves[i].block);
+	if (!bh_old) {
+		ret = -EIO;
+		goto release_dx;
+	}
+	memcpy(copy, bh_old->b_data, OUICHEFS_BLOCK_SIZE);
+	n = ouichefs_leaf_sort(copy, 0, ents);
+	if (n < 0) {
+		ret = n;
+		goto release_old;
+	}
+	if (n < 2) {
+		ret = -EMLINK;
+		goto release_old;
+	}
+
+	/*
+	 * Split at the hash that halves the room used, or at the nearest
+	 * change of hash: records with the same hash stay together.
+	 */
+	for (j = 0, total = 0; j < n; j++)
+		total += OUICHEFS_DIRENT_LEN(ents[j]->name_len);
+	for (j = 0, used = 0; j < n - 1 && used < total / 2; j++)
+		used += OUICHEFS_DIRENT_LEN(ents[j]->name_len);
+	j = max(j, 1);
+	for (k = j; k < n && ents[k]->hash == ents[k - 1]->hash; k++)
+		;
+	if (k == n)
+		for (k = j; k > 0 && ents[k]->hash == ents[k - 1]->hash; k--)
+			;
+	if (!k) {
+		ret = -EMLINK;
+		goto release_old;
+	}
+	split = ents[k]->hash;
+
+	bh_new = ouichefs_dir_new_block(dir, &new_bno);
+	if (IS_ERR(bh_new)) {
+		ret = PTR_ERR(bh_new);
+		goto release_old;
+	}
+
+	/* Pack the records below split in the old leaf, the others in the new */
+	ouichefs_leaf_init(bh_old->b_data);
+	ouichefs_leaf_init(bh_new->b_data);
+	for (j = 0; j < n; j++) {
+		de = ouichefs_leaf_alloc(j < k ? bh_old->b_data :
+						 bh_new->b_data,
+					 ents[j]->name_len);
+		ouichefs_dirent_set(de, ents[j]->inode, ents[j]->hash,
+				    ents[j]->name, ents[j]->name_len,
+				    ents[j]->file_type);
+		if (j >= k)
+			ouichefs_ncache_move(dir, ents[j]->name,
+					     ents[j]->name_len, ents[j]->hash,
+					     new_bno);
+	}
+	mark_buffer_dirty(bh_new);
+	mark_buffer_dirty(bh_old);
+	brelse(bh_new);
+
+	/* List the new leaf after the old one */
+	i++;
+	memmove(&dx->leaves[i + 1], &dx->leaves[i],
+		(dx->nr_leaves - i) * sizeof(dx->leaves[0]));
+	dx->leaves[i].hash = split;
+	dx->leaves[i].block = new_bno;
+	dx->nr_leaves++;
+	mark_buffer_dirty(bh_dx);
+
+release_old:
+	brelse(bh_old);
+release_dx:
+	brelse(bh_dx);
+free:
+	kfree(ents);
+	kfree(copy);
+
+	return ret;
+}
+
+/*
+ * Initialize the block of the new directory dir, overwriting what a previous
+ * file left there.
+ */
+int ouichefs_dir_init(struct inode *dir)
+{
+	struct buffer_head *bh;
+
+	bh = sb_bread(dir->i_sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh)
+		return -EIO;
+
+	if (ouichefs_dir_hashed(dir))
+		ouichefs_leaf_init(bh->b_data);
+	else
+		memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+static int ouichefs_leaf_scan(struct buffer_head *bh,
+			      int (*fn)(void *data, const char *name,
+					unsigned int len, uint32_t hash,
+					const struct ouichefs_dir_slot *slot),
+			      void *data)
+{
+	struct ouichefs_dir_slot slot = { .bno = bh->b_blocknr };
+	struct ouichefs_dirent *de;
+	unsigned int off;
+	int ret;
+
+	for (off = 0; off < OUICHEFS_BLOCK_SIZE; off += de->rec_len) {
+		de = ouichefs_dirent_at(bh->b_data, off);
+		if (!de)
+			return -EIO;
+		if (!de->inode)
+			continue;
+		slot.ino = de->inode;
+		ret = fn(data, de->name, de->name_len, de->hash, &slot);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Call fn on each entry of dir, with the hash of its name and where it lives.
+ * Stop at the first nonzero value returned by fn, and return it.
+ */
+int ouichefs_dir_scan(struct inode *dir,
+		      int (*fn)(void *data, const char *name, unsigned int len,
+				uint32_t hash,
+				const struct ouichefs_dir_slot *slot),
+		      void *data)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_block *dblock;
+	struct ouichefs_dx_block *dx;
+	struct ouichefs_dir_slot slot;
+	struct buffer_head *bh, *bh_leaf;
+	struct ouichefs_file *f;
+	unsigned int len;
+	int i, ret = 0;
+
+	if (ci->i_flags & OUICHEFS_INODE_INDEXED)
+		bh = ouichefs_dx_read(dir);
+	else
+		bh = sb_bread(dir->i_sb, ci->index_block) ?: ERR_PTR(-EIO);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	if (ci->i_flags & OUICHEFS_INODE_INDEXED) {
+		dx = (struct ouichefs_dx_block *)bh->b_data;
+		for (i = 0; i < dx->nr_leaves && !ret; i++) {
+			bh_leaf = sb_bread(dir->i_sb, dx->leaves[i].block);
+			if (!bh_leaf) {
+				ret = -EIO;
+				break;
+			}
+			ret = ouichefs_leaf_scan(bh_leaf, fn, data);
+			brelse(bh_leaf);
+		}
+	} else if (ouichefs_dir_hashed(dir)) {
+		ret = ouichefs_leaf_scan(bh, fn, data);
+	} else {
+		dblock = (struct ouichefs_dir_block *)bh->b_data;
+		slot.bno = ci->index_block;
+		for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+			f = &dblock->files[i];
+			if (!f->inode) {
+				if (ouichefs_dir_sparse(dir))
+					continue;
+				break;
+			}
+			len = strnlen(f->filename, OUICHEFS_FILENAME_LEN);
+			slot.ino = f->inode;
+			ret = fn(data, f->filename, len,
+				 ouichefs_name_hash(f->filename, len), &slot);
+			if (ret)
+				break;
+		}
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Look for name in dir. Store the inode number of its entry in *ino, or 0 if
+ * there is none.
+ */
+int ouichefs_dir_find(struct inode *dir, const struct qstr *name,
+		      uint32_t *ino)
+{
+	uint32_t hash = ouichefs_name_hash(name->name, name->len);
+	struct ouichefs_dir_slot slot;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int i, ret = 0;
+
+	*ino = 0;
+
+	/* Answer from the name index of dir, built on first use */
+	if (ouichefs_ncache_find(dir, name, hash, &slot)) {
+		*ino = slot.ino;
+		return 0;
+	}
+
+	/* Read the directory block, or the leaf that holds hash, on disk */
+	if (ouichefs_dir_hashed(dir))
+		bno = ouichefs_hdir_leaf(dir, hash);
+	else
+		bno = OUICHEFS_INODE(dir)->index_block;
+	if (!bno)
+		return -EIO;
+	bh = sb_bread(dir->i_sb, bno);
+	if (!bh)
+		return -EIO;
+
+	if (ouichefs_dir_hashed(dir)) {
+		struct ouichefs_dirent *de;
+
+		de = ouichefs_leaf_lookup(bh->b_data, hash, name);
+		if (IS_ERR(de))
+			ret = PTR_ERR(de);
+		else if (de)
+			*ino = de->inode;
+	} else {
+		struct ouichefs_dir_block *dblock =
+			(struct ouichefs_dir_block *)bh->b_data;
+		struct ouichefs_file *f;
+
+		for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+			f = &dblock->files[i];
+			if (!f->inode) {
+				if (ouichefs_dir_sparse(dir))
+					continue;
+				break;
+			}
+			if (ouichefs_name_match(f->filename, name)) {
+				*ino = f->inode;
+				break;
+			}
+		}
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Add an entry for name, pointing to inode, to dir. name must not already be
+ * in dir. Hashed directories also record the file type of inode, for readdir.
+ * Return -EMLINK if dir is full. With the large directories feature, a full
+ * leaf is split instead.
+ */
+int ouichefs_dir_add(struct inode *dir, const struct qstr *name,
+		     struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	uint32_t hash = ouichefs_name_hash(name->name, name->len);
+	struct ouichefs_dir_slot slot;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int i, ret = 0;
+
+retry:
+	if (ouichefs_dir_hashed(dir))
+		bno = ouichefs_hdir_leaf(dir, hash);
+	else
+		bno = OUICHEFS_INODE(dir)->index_block;
+	if (!bno)
+		return -EIO;
+	bh = sb_bread(dir->i_sb, bno);
+	if (!bh)
+		return -EIO;
+
+	if (ouichefs_dir_hashed(dir)) {
+		struct ouichefs_dirent *de;
+
+		de = ouichefs_leaf_alloc(bh->b_data, name->len);
+		if (IS_ERR(de)) {
+			ret = PTR_ERR(de);
+			goto end;
+		}
+		if (!de) {
+			brelse(bh);
+			if (!(sbi->features & OUICHEFS_FEATURE_LARGE_DIRS))
+				return -EMLINK;
+			/*
+			 * The leaf that holds hash after the split may still
+			 * lack room for a long name, split again if so.
+			 */
+			ret = ouichefs_dx_split(dir, hash);
+			if (ret)
+				return ret;
+			goto retry;
+		}
+		ouichefs_dirent_set(de, inode->i_ino, hash, name->name,
+				    name->len, fs_umode_to_ftype(inode->i_mode));
+	} else {
+		struct ouichefs_dir_block *dblock =
+			(struct ouichefs_dir_block *)bh->b_data;
+
+		/* Use the first free entry, the directory is full if none */
+		for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
+			if (dblock->files[i].inode == 0)
+				break;
+		if (i == OUICHEFS_MAX_SUBFILES) {
+			ret = -EMLINK;
+			goto end;
+		}
+		dblock->files[i].inode = inode->i_ino;
+		strtomem_pad(dblock->files[i].filename, name->name, 0);
+	}
+	mark_buffer_dirty(bh);
+
+	slot.ino = inode->i_ino;
+	slot.bno = bno;
+	ouichefs_ncache_add(dir, name, hash, &slot);
+
+end:
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Remove the entry for name from dir.
+ */
+int ouichefs_dir_remove(struct inode *dir, const struct qstr *name)
+{
+	uint32_t hash = ouichefs_name_hash(name->name, name->len);
+	struct ouichefs_dir_slot slot;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int i, ret = -ENOENT;
+
+	/* The name index knows which block holds the entry */
+	if (ouichefs_ncache_find(dir, name, hash, &slot)) {
+		if (!slot.ino)
+			return -ENOENT;
+		bno = slot.bno;
+	} else if (ouichefs_dir_hashed(dir))
+		bno = ouichefs_hdir_leaf(dir, hash);
+	else
+		bno = OUICHEFS_INODE(dir)->index_block;
+	if (!bno)
+		return -EIO;
+	bh = sb_bread(dir->i_sb, bno);
+	if (!bh)
+		return -EIO;
+
+	if (ouichefs_dir_hashed(dir)) {
+		struct ouichefs_dirent *de;
+
+		/*
+		 * Only clear the record, its room is reclaimed by the next
+		 * insertion. Leaves are never merged, an empty one stays listed.
+		 */
+		de = ouichefs_leaf_lookup(bh->b_data, hash, name);
+		if (IS_ERR(de)) {
+			ret = PTR_ERR(de);
+		} else if (de) {
+			de->inode = 0;
+			ret = 0;
+		}
+	} else if (ouichefs_dir_sparse(dir)) {
+		struct ouichefs_dir_block *dblock =
+			(struct ouichefs_dir_block *)bh->b_data;
+
+		/* Only clear the entry, the others do not move */
+		for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+			if (dblock->files[i].inode &&
+			    ouichefs_name_match(dblock->files[i].filename, name)) {
+				memset(&dblock->files[i], 0,
+				       sizeof(struct ouichefs_file));
+				ret = 0;
+				break;
+			}
+		}
+	} else {
+		struct ouichefs_dir_block *dblock =
+			(struct ouichefs_dir_block *)bh->b_data;
+		int f_id = -1, nr_subs;
+
+		/* Search for the entry and get number of subfiles */
+		for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+			if (!dblock->files[i].inode)
+				break;
+			if (ouichefs_name_match(dblock->files[i].filename, name))
+				f_id = i;
+		}
+		nr_subs = i;
+
+		/* Keep entries packed */
+		if (f_id >= 0) {
+			memmove(dblock->files + f_id, dblock->files + f_id + 1,
+				(nr_subs - f_id - 1) *
+					sizeof(struct ouichefs_file));
+			memset(&dblock->files[nr_subs - 1], 0,
+			       sizeof(struct ouichefs_file));
+			ret = 0;
+		}
+	}
+	if (!ret) {
+		mark_buffer_dirty(bh);
+		ouichefs_ncache_remove(dir, name, hash);
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Return 1 if the leaf at block bno has no entry, 0 otherwise.
+ */
+static int ouichefs_hdir_leaf_empty(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_dirent *de;
+	struct buffer_head *bh;
+	unsigned int off;
+	int ret = 1;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+
+	for (off = 0; off < OUICHEFS_BLOCK_SIZE; off += de->rec_len) {
+		de = ouichefs_dirent_at(bh->b_data, off);
+		if (!de) {
+			ret = -EIO;
+			break;
+		}
+		if (de->inode) {
+			ret = 0;
+			break;
+		}
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Return 1 if dir has no entry, 0 otherwise.
+ */
+int ouichefs_dir_empty(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct buffer_head *bh;
+	int i, ret = 1;
+
+	if (ouichefs_dir_hashed(dir) && !(ci->i_flags & OUICHEFS_INODE_INDEXED))
+		return ouichefs_hdir_leaf_empty(dir->i_sb, ci->index_block);
+
+	if (ci->i_flags & OUICHEFS_INODE_INDEXED)
+		bh = ouichefs_dx_read(dir);
+	else
+		bh = sb_bread(dir->i_sb, ci->index_block) ?: ERR_PTR(-EIO);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+
+	if (ci->i_flags & OUICHEFS_INODE_INDEXED) {
+		struct ouichefs_dx_block *dx =
+			(struct ouichefs_dx_block *)bh->b_data;
+
+		/* Removing entries may leave any leaf empty, check them all */
+		for (i = 0; i < dx->nr_leaves && ret == 1; i++)
+			ret = ouichefs_hdir_leaf_empty(dir->i_sb,
+						       dx->leaves[i].block);
+	} else {
+		struct ouichefs_dir_block *dblock =
+			(struct ouichefs_dir_block *)bh->b_data;
+
+		/* Without holes, the first entry is used if any is */
+		for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+			if (dblock->files[i].inode) {
+				ret = 0;
+				break;
+			}
+			if (!ouichefs_dir_sparse(dir))
+				break;
+		}
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Readdir is often followed by a stat of each entry, start reading the inode
+ * store block of ino. *last is the last block read ahead.
+ */
+static void ouichefs_dir_readahead(struct super_block *sb, uint32_t ino,
+				   uint32_t *last)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t block = ino / sbi->inodes_per_block + 1;
+
+	if (block != *last)
+		sb_breadahead(sb, block);
+	*last = block;
+}
+
+/*
+ * Positions in hashed directories. After . and .., a position is made of the
+ * hash of the next entry to commit, and of its rank among the entries with the
+ * same hash, that are committed in name order. Such entries always share a
+ * leaf, so the rank fits in OUICHEFS_POS_MINOR_BITS bits. Positions stay valid
+ * when entries are added, removed or moved to a new leaf by a split.
+ *
+ * 32-bit callers cannot handle positions above 31 bits: they only get the
+ * upper 31 bits of the hash, and entries sharing them are committed again if
+ * ctx fills up among them.
+ */
+#define OUICHEFS_POS_MINOR_BITS 8
+#define OUICHEFS_POS_EOF ((((loff_t)U32_MAX + 1) << OUICHEFS_POS_MINOR_BITS) + 2)
+#define OUICHEFS_POS_EOF_32 ((loff_t)S32_MAX)
+
+static inline bool is_32bit_api(void)
+{
+#ifdef CONFIG_COMPAT
+	return in_compat_syscall();
+#else
+	return BITS_PER_LONG == 32;
+#endif
+}
+
+/* Whether the positions of dir must fit in 31 bits, as for ext4 */
+static bool ouichefs_pos_32bit(struct file *dir)
+{
+	if (dir->f_mode & FMODE_32BITHASH)
+		return true;
+	if (dir->f_mode & FMODE_64BITHASH)
+		return false;
+
+	return is_32bit_api();
+}
+
+static loff_t ouichefs_hash2pos(struct file *dir, uint32_t hash,
+				unsigned int minor)
+{
+	if (ouichefs_pos_32bit(dir))
+		return clamp_t(loff_t, hash >> 1, 2, OUICHEFS_POS_EOF_32 - 1);
+
+	return (((loff_t)hash << OUICHEFS_POS_MINOR_BITS) | minor) + 2;
+}
+
+/*
+ * Return in *hash and *minor the entry position pos points to, or false if it
+ * is past the last entry.
+ */
+static bool ouichefs_pos2hash(struct file *dir, loff_t pos, uint32_t *hash,
+			      unsigned int *minor)
+{
+	if (ouichefs_pos_32bit(dir)) {
+		if (pos >= OUICHEFS_POS_EOF_32)
+			return false;
+		*hash = pos == 2 ? 0 : (uint32_t)pos << 1;
+		*minor = 0;
+		return true;
+	}
+
+	if (pos >= OUICHEFS_POS_EOF)
+		return false;
+	*hash = (pos - 2) >> OUICHEFS_POS_MINOR_BITS;
+	*minor = (pos - 2) & ((1 << OUICHEFS_POS_MINOR_BITS) - 1);
+	return true;
+}
+
+/*
+ * Commit the entries of the hashed directory dir to ctx in hash order, leaf by
+ * leaf, from the position in ctx->pos.
+ */
+static int ouichefs_hdir_iterate(struct file *dir, struct dir_context *ctx)
+{
+	struct inode *inode = file_inode(dir);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh_dx = NULL, *bh;
+	struct ouichefs_dx_block *dx = NULL;
+	struct ouichefs_dirent **ents, *de;
+	uint32_t leaf = 0, nr_leaves = 1, last = 0, start;
+	unsigned int minor, rank = 0;
+	struct blk_plug plug;
+	int i, n, ret = 0;
+
+	BUILD_BUG_ON(OUICHEFS_DIRENT_MAX > 1 << OUICHEFS_POS_MINOR_BITS);
+
+	if (!ouichefs_pos2hash(dir, ctx->pos, &start, &minor))
+		return 0;
+
+	if (ci->i_flags & OUICHEFS_INODE_INDEXED) {
+		bh_dx = ouichefs_dx_read(inode);
+		if (IS_ERR(bh_dx))
+			return PTR_ERR(bh_dx);
+		dx = (struct ouichefs_dx_block *)bh_dx->b_data;
+		nr_leaves = dx->nr_leaves;
+		leaf = ouichefs_dx_search(dx, start);
+	}
+
+	ents = kmalloc_array(OUICHEFS_DIRENT_MAX, sizeof(*ents), GFP_KERNEL);
+	if (!ents) {
+		ret = -ENOMEM;
+		goto release_dx;
+	}
+
+	blk_start_plug(&plug);
+	for (; leaf < nr_leaves; leaf++) {
+		bh = sb_bread(sb, dx ? dx->leaves[leaf].block : ci->index_block);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+
+		/* Sort the entries that were not committed yet */
+		n = ouichefs_leaf_sort(bh->b_data, start, ents);
+		if (n < 0) {
+			brelse(bh);
+			ret = n;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			de = ents[i];
+			rank = i && de->hash == ents[i - 1]->hash ? rank + 1 : 0;
+			/* Committed by a previous call */
+			if (de->hash == start && rank < minor)
+				continue;
+			ctx->pos = ouichefs_hash2pos(dir, de->hash, rank);
+			if (!dir_emit(ctx, de->name, de->name_len, de->inode,
+				      fs_ftype_to_dtype(de->file_type)))
+				break;
+			ouichefs_dir_readahead(sb, de->inode, &last);
+		}
+		brelse(bh);
+		if (i < n)
+			break;
+
+		/* Resume at the first hash of the next leaf */
+		if (leaf + 1 < nr_leaves) {
+			start = dx->leaves[leaf + 1].hash;
+			minor = 0;
+			ctx->pos = ouichefs_hash2pos(dir, start, 0);
+		} else {
+			ctx->pos = ouichefs_pos_32bit(dir) ? OUICHEFS_POS_EOF_32 :
+							     OUICHEFS_POS_EOF;
+		}
+	}
+	blk_finish_plug(&plug);
+
+	kfree(ents);
+release_dx:
+	brelse(bh_dx);
+
+	return ret;
+}
 
 /*
  * Iterate over the files contained in dir and commit them in ctx.
  * This function is called by the VFS while ctx->pos changes.
  * Return 0 on success.
  */
-static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
+int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(dir);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
+	struct ouichefs_dir_block *dblock;
 	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
+	struct ouichefs_file *f;
+	struct blk_plug plug;
+	uint32_t last = 0;
 	int i;
 
 	/* Check that dir is a directory */
 	if (!S_ISDIR(inode->i_mode))
 		return -ENOTDIR;
 
+	/* Commit . and .. to ctx */
+	if (!dir_emit_dots(dir, ctx))
+		return 0;
+
+	if (ouichefs_dir_hashed(inode))
+		return ouichefs_hdir_iterate(dir, ctx);
+
 	/*
 	 * Check that ctx->pos is not bigger than what we can handle (including
 	 * . and ..)
@@ -39,26 +1062,35 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 	if (ctx->pos > OUICHEFS_MAX_SUBFILES + 2)
 		return 0;
 
-	/* Commit . and .. to ctx */
-	if (!dir_emit_dots(dir, ctx))
-		return 0;
-
 	/* Read the directory index block on disk */
 	bh = sb_bread(sb, ci->index_block);
 	if (!bh)
 		return -EIO;
 	dblock = (struct ouichefs_dir_block *)bh->b_data;
 
-	/* Iterate over the index block and commit subfiles */
+	/*
+	 * Iterate over the index block and commit subfiles. ctx->pos is the
+	 * index of the next entry plus 2, holes of sparse directories are
+	 * skipped. Entries have no room for the file type.
+	 */
+	blk_start_plug(&plug);
 	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES; i++) {
 		f = &dblock->files[i];
-		if (!f->inode)
+		if (!f->inode) {
+			if (ouichefs_dir_sparse(inode)) {
+				ctx->pos++;
+				continue;
+			}
 			break;
-		if (!dir_emit(ctx, f->filename, OUICHEFS_FILENAME_LEN, f->inode,
-			      DT_UNKNOWN))
+		}
+		if (!dir_emit(ctx, f->filename,
+			      strnlen(f->filename, OUICHEFS_FILENAME_LEN),
+			      f->inode, DT_UNKNOWN))
 			break;
+		ouichefs_dir_readahead(sb, f->inode, &last);
 		ctx->pos++;
 	}
+	blk_finish_plug(&plug);
 
 	brelse(bh);
 
@@ -68,4 +1100,6 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 const struct file_operations ouichefs_dir_ops = {
 	.owner = THIS_MODULE,
 	.iterate_shared = ouichefs_iterate,
+	.unlocked_ioctl = ouichefs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
@@ -17,24 +17,266 @@
 #include "bitmap.h"
 
 /*
- * Map the buffer_head passed in argument with the iblock-th block of the file
- * represented by inode. If the requested block is not allocated and create is
- * true, allocate a new block on disk and map it.
+ * Inline files keep their content in their inode store slot, right after the
+ * on-disk inode, as long as it fits in sbi->inline_size bytes. They have no
+ * index block. Once they grow larger, they are converted to the usual layout.
  */
-static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
-				   struct buffer_head *bh_result, int create)
+static inline bool ouichefs_is_inline(struct inode *inode)
+{
+	return OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_INLINE;
+}
+
+/*
+ * Read the inode store block of an inline file. Return its buffer, and the
+ * inline data area of inode in *data.
+ */
+static struct buffer_head *ouichefs_inline_bh(struct inode *inode, char **data)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct buffer_head *bh;
+	uint32_t ino = inode->i_ino;
+
+	bh = sb_bread(inode->i_sb, ino / sbi->inodes_per_block + 1);
+	if (!bh)
+		return NULL;
+	*data = OUICHEFS_INLINE_DATA(sbi, bh->b_data +
+					       (ino % sbi->inodes_per_block) *
+						       sbi->inode_size);
+
+	return bh;
+}
+
+/*
+ * Fill page with the content of the inline file inode.
+ */
+static int ouichefs_inline_read_page(struct inode *inode, struct page *page)
+{
+	struct buffer_head *bh;
+	char *data, *kaddr;
+	size_t size = min_t(size_t, inode->i_size, PAGE_SIZE);
+
+	bh = ouichefs_inline_bh(inode, &data);
+	if (!bh)
+		return -EIO;
+
+	kaddr = kmap_local_page(page);
+	if (!page->index) {
+		memcpy(kaddr, data, size);
+		memset(kaddr + size, 0, PAGE_SIZE - size);
+	} else {
+		memset(kaddr, 0, PAGE_SIZE);
+	}
+	kunmap_local(kaddr);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Copy the first size bytes of page, the first page of the inline file inode,
+ * to the inline data area.
+ */
+static int ouichefs_inline_write_page(struct inode *inode, struct page *page,
+				      size_t size)
+{
+	struct buffer_head *bh;
+	char *data, *kaddr;
+
+	bh = ouichefs_inline_bh(inode, &data);
+	if (!bh)
+		return -EIO;
+
+	kaddr = kmap_local_page(page);
+	memcpy(data, kaddr, size);
+	kunmap_local(kaddr);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Allocate a zeroed index block for the regular file inode.
+ *
+ * The index block and the data blocks that are written through the buffer
+ * cache are dirtied with mark_buffer_dirty_inode(), so that fsync() writes
+ * them back along with the inode.
+ */
+static int ouichefs_alloc_index(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_index;
+	uint32_t bno;
+
+	bno = get_free_block(OUICHEFS_SB(sb));
+	if (!bno)
+		return -ENOSPC;
+
+	/* The block is fully written, do not read it */
+	bh_index = sb_getblk(sb, bno);
+	if (!bh_index) {
+		put_block(OUICHEFS_SB(sb), bno);
+		return -EIO;
+	}
+	lock_buffer(bh_index);
+	memset(bh_index->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh_index);
+	unlock_buffer(bh_index);
+	mark_buffer_dirty_inode(bh_index, inode);
+	brelse(bh_index);
+
+	ci->index_block = bno;
+	inode->i_blocks++;
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * Move the content of the inline file inode to a data block, and list it in a
+ * direct block pointer, or in a new index block without the direct blocks
+ * feature. Called with the inode locked, before the file grows larger than
+ * what fits inline.
+ */
+static int ouichefs_convert_inline(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh, *bh_data, *bh_index;
+	uint32_t data_bno = 0;
+	char *data;
+	int ret;
+
+	bh = ouichefs_inline_bh(inode, &data);
+	if (!bh)
+		return -EIO;
+
+	if (!sbi->nr_direct) {
+		ret = ouichefs_alloc_index(inode);
+		if (ret)
+			goto release;
+	}
+	if (inode->i_size) {
+		data_bno = get_free_block(sbi);
+		if (!data_bno) {
+			ret = -ENOSPC;
+			goto put_index;
+		}
+
+		/* The block is fully written, do not read it */
+		bh_data = sb_getblk(sb, data_bno);
+		if (!bh_data) {
+			ret = -EIO;
+			goto put_data;
+		}
+		lock_buffer(bh_data);
+		memcpy(bh_data->b_data, data, inode->i_size);
+		memset(bh_data->b_data + inode->i_size, 0,
+		       OUICHEFS_BLOCK_SIZE - inode->i_size);
+		set_buffer_uptodate(bh_data);
+		unlock_buffer(bh_data);
+		mark_buffer_dirty_inode(bh_data, inode);
+		brelse(bh_data);
+	}
+
+	if (sbi->nr_direct) {
+		memset(ci->i_direct, 0, sizeof(ci->i_direct));
+		ci->i_direct[0] = data_bno;
+	} else if (data_bno) {
+		bh_index = sb_bread(sb, ci->index_block);
+		if (!bh_index) {
+			ret = -EIO;
+			goto put_data;
+		}
+		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+		index->blocks[0] = data_bno;
+		mark_buffer_dirty_inode(bh_index, inode);
+		brelse(bh_index);
+	}
+
+	memset(data, 0, sbi->inline_size);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	ci->i_flags &= ~OUICHEFS_INODE_INLINE;
+	inode->i_blocks = (ci->index_block ? 1 : 0) + (data_bno ? 1 : 0);
+	mark_inode_dirty(inode);
+
+	return 0;
+
+put_data:
+	if (data_bno)
+		put_block(sbi, data_bno);
+put_index:
+	if (ci->index_block) {
+		put_block(sbi, ci->index_block);
+		ci->index_block = 0;
+		inode->i_blocks = 0;
+	}
+release:
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * inode->i_blocks counts the blocks of a regular file: its data blocks, and its
+ * index block if it has one. It is updated as blocks are allocated and freed.
+ *
+ * Return in *bno the physical block number of the iblock-th block of the file
+ * represented by inode, or 0 if it is not allocated. If create is true, allocate
+ * a missing block on disk, and set *new: its content is whatever was left there,
+ * unless the scrub policy erased it. The first sbi->nr_direct blocks are listed
+ * in the inode, so that small files are mapped without reading the index block.
+ */
+static int ouichefs_map_block(struct inode *inode, sector_t iblock, bool create,
+			      uint32_t *bno, bool *new)
 {
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
 	struct buffer_head *bh_index;
-	int ret = 0, bno;
+	int ret = 0;
+
+	*bno = 0;
+	*new = false;
 
 	/* If block number exceeds filesize, fail */
 	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
 		return -EFBIG;
 
+	/* Inline files are never mapped, they are converted first */
+	if (WARN_ON_ONCE(ouichefs_is_inline(inode)))
+		return -EIO;
+
+	if (iblock < sbi->nr_direct) {
+		if (!ci->i_direct[iblock] && create) {
+			ci->i_direct[iblock] = get_free_block(sbi);
+			if (!ci->i_direct[iblock])
+				return -ENOSPC;
+			inode->i_blocks++;
+			mark_inode_dirty(inode);
+			*new = true;
+		}
+		*bno = ci->i_direct[iblock];
+		return 0;
+	}
+	iblock -= sbi->nr_direct;
+
+	/* With direct blocks, the index block is only allocated when needed */
+	if (!ci->index_block) {
+		if (!create)
+			return 0;
+		ret = ouichefs_alloc_index(inode);
+		if (ret)
+			return ret;
+	}
+
 	/* Read index block from disk */
 	bh_index = sb_bread(sb, ci->index_block);
 	if (!bh_index)
@@ -45,23 +287,18 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	 * Check if iblock is already allocated. If not and create is true,
 	 * allocate it. Else, get the physical block number.
 	 */
-	if (index->blocks[iblock] == 0) {
-		if (!create) {
-			ret = 0;
-			goto brelse_index;
-		}
-		bno = get_free_block(sbi);
-		if (!bno) {
+	if (index->blocks[iblock] == 0 && create) {
+		index->blocks[iblock] = get_free_block(sbi);
+		if (!index->blocks[iblock]) {
 			ret = -ENOSPC;
 			goto brelse_index;
 		}
-		index->blocks[iblock] = bno;
-	} else {
-		bno = index->blocks[iblock];
+		mark_buffer_dirty_inode(bh_index, inode);
+		inode->i_blocks++;
+		mark_inode_dirty(inode);
+		*new = true;
 	}
-
-	/* Map the physical block to the given buffer_head */
-	map_bh(bh_result, sb, bno);
+	*bno = index->blocks[iblock];
 
 brelse_index:
 	brelse(bh_index);
@@ -69,24 +306,154 @@ brelse_index:
 	return ret;
 }
 
+/*
+ * Release the blocks of the file represented by inode from the first-th one
+ * on. With direct blocks, the index block is released too once it no longer
+ * lists any block.
+ */
+static int ouichefs_truncate_blocks(struct inode *inode, sector_t first)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	sector_t iblock;
+
+	for (iblock = first; iblock < sbi->nr_direct; iblock++) {
+		if (!ci->i_direct[iblock])
+			continue;
+		ouichefs_free_block(sb, ci->i_direct[iblock]);
+		ci->i_direct[iblock] = 0;
+		inode->i_blocks--;
+	}
+	mark_inode_dirty(inode);
+
+	if (!ci->index_block)
+		return 0;
+	first = first > sbi->nr_direct ? first - sbi->nr_direct : 0;
+
+	/* Read index block to remove unused blocks */
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index)
+		return -EIO;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	for (iblock = first; iblock < OUICHEFS_BLOCK_SIZE >> 2; iblock++) {
+		if (!index->blocks[iblock])
+			continue;
+		ouichefs_free_block(sb, index->blocks[iblock]);
+		index->blocks[iblock] = 0;
+		inode->i_blocks--;
+	}
+	mark_buffer_dirty_inode(bh_index, inode);
+	brelse(bh_index);
+
+	if (!first && sbi->nr_direct) {
+		ouichefs_free_block(sb, ci->index_block);
+		ci->index_block = 0;
+		inode->i_blocks--;
+	}
+
+	return 0;
+}
+
+/*
+ * Map the buffer_head passed in argument with the iblock-th block of the file
+ * represented by inode. If the requested block is not allocated and create is
+ * true, allocate a new block on disk and map it.
+ */
+static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh_result, int create)
+{
+	uint32_t bno;
+	bool new;
+	int ret;
+
+	ret = ouichefs_map_block(inode, iblock, create, &bno, &new);
+	if (ret || !bno)
+		return ret;
+
+	/* Map the physical block to the given buffer_head */
+	map_bh(bh_result, inode->i_sb, bno);
+
+	/* Have the parts of a new block that are not written zeroed */
+	if (new)
+		set_buffer_new(bh_result);
+
+	return 0;
+}
+
 /*
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
  */
 static void ouichefs_readahead(struct readahead_control *rac)
 {
+	/* Inline files are read page by page by ouichefs_read_folio() */
+	if (ouichefs_is_inline(rac->mapping->host))
+		return;
+
 	mpage_readahead(rac, ouichefs_file_get_block);
 }
 
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	int ret;
+
+	if (ouichefs_is_inline(inode)) {
+		ret = ouichefs_inline_read_page(inode, &folio->page);
+		folio_unlock(folio);
+		return ret;
+	}
+
+	return block_read_full_folio(folio, ouichefs_file_get_block);
+}
+
 /*
  * Called by the page cache to write a dirty page to the physical disk (when
  * sync is called or when memory is needed).
  */
 static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
 {
+	struct inode *inode = page->mapping->host;
+	int ret;
+
+	/* Only the first page of an inline file holds data */
+	if (ouichefs_is_inline(inode)) {
+		ret = 0;
+		if (!page->index)
+			ret = ouichefs_inline_write_page(inode, page,
+							 inode->i_size);
+		unlock_page(page);
+		return ret;
+	}
+
 	return block_write_full_page(page, ouichefs_file_get_block, wbc);
 }
 
+/*
+ * Return the number of blocks that inode may need to grow to end bytes: the
+ * data blocks it does not have yet, and its index block if it needs one.
+ */
+static uint32_t ouichefs_nr_allocs(struct inode *inode, loff_t end)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t need = DIV_ROUND_UP(end, OUICHEFS_BLOCK_SIZE);
+	uint32_t have = inode->i_blocks;
+
+	if (!ci->index_block) {
+		if (need > sbi->nr_direct)
+			need++;
+	} else if (have) {
+		have--;
+	}
+
+	return need > have ? need - have : 0;
+}
+
 /*
  * Called by the VFS when a write() syscall occurs on file before writing the
  * data in the page cache. This functions checks if the write will be able to
@@ -98,17 +465,38 @@ static int ouichefs_write_begin(struct file *file,
 				void **fsdata)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
+	struct inode *inode = file->f_inode;
+	struct page *page;
 	int err;
 	uint32_t nr_allocs = 0;
 
 	/* Check if the write can be completed (enough space?) */
 	if (pos + len > OUICHEFS_MAX_FILESIZE)
 		return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
-	else
-		nr_allocs = 0;
+
+	/* Inline files are written through their first page */
+	if (ouichefs_is_inline(inode)) {
+		if (pos + len <= sbi->inline_size) {
+			page = grab_cache_page_write_begin(mapping, 0);
+			if (!page)
+				return -ENOMEM;
+			if (!PageUptodate(page)) {
+				err = ouichefs_inline_read_page(inode, page);
+				if (err) {
+					unlock_page(page);
+					put_page(page);
+					return err;
+				}
+			}
+			*pagep = page;
+			return 0;
+		}
+		err = ouichefs_convert_inline(inode);
+		if (err)
+			return err;
+	}
+	nr_allocs = ouichefs_nr_allocs(inode, max_t(loff_t, pos + len,
+						     inode->i_size));
 	if (nr_allocs > sbi->nr_free_blocks)
 		return -ENOSPC;
 
@@ -126,7 +514,8 @@ static int ouichefs_write_begin(struct file *file,
 /*
  * Called by the VFS after writing data from a write() syscall to the page
  * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * necessary. Only the size and the block count are written synchronously, see
+ * file_update_time() for timestamps.
  */
 static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 			      loff_t pos, unsigned int len, unsigned int copied,
@@ -134,56 +523,37 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 {
 	int ret;
 	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
+
+	if (ouichefs_is_inline(inode)) {
+		if (pos + copied > inode->i_size) {
+			i_size_write(inode, pos + copied);
+			mark_inode_dirty(inode);
+		}
+		ret = ouichefs_inline_write_page(inode, page, inode->i_size);
+		unlock_page(page);
+		put_page(page);
+		if (ret)
+			return ret;
+		return copied;
+	}
 
 	/* Complete the write() */
 	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
 	if (ret < len) {
 		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
 		       __func__, __LINE__);
-	} else {
-		uint32_t nr_blocks_old = inode->i_blocks;
-
-		/* Update inode metadata */
-		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
-		inode->i_mtime = inode->i_ctime = current_time(inode);
-		mark_inode_dirty(inode);
-
-		/* If file is smaller than before, free unused blocks */
-		if (nr_blocks_old > inode->i_blocks) {
-			int i;
-			struct buffer_head *bh_index;
-			struct ouichefs_file_index_block *index;
-
-			/* Free unused blocks from page cache */
-			truncate_pagecache(inode, inode->i_size);
-
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
-				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-				       file->f_path.dentry->d_name.name,
-				       nr_blocks_old - inode->i_blocks);
-				goto end;
-			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
-
-			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
-			     i++) {
-				put_block(OUICHEFS_SB(sb), index->blocks[i]);
-				index->blocks[i] = 0;
-			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
-		}
 	}
-end:
+
+	/*
+	 * Timestamps were already updated by file_modified() in the write
+	 * path, generic_write_end() dirtied the inode if its size changed, and
+	 * ouichefs_map_block() if blocks were allocated.
+	 */
 	return ret;
 }
 
 const struct address_space_operations ouichefs_aops = {
+	.read_folio = ouichefs_read_folio,
 	.readahead = ouichefs_readahead,
 	.writepage = ouichefs_writepage,
 	.write_begin = ouichefs_write_begin,
@@ -195,28 +565,27 @@ static int ouichefs_open(struct inode *inode, struct file *file) {
 	bool rdwr = (file->f_flags & O_RDWR) != 0;
 	bool trunc = (file->f_flags & O_TRUNC) != 0;
 
-	if ((wronly || rdwr) && trunc && (inode->i_size != 0)) {
-		struct super_block *sb = inode->i_sb;
-		struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-		struct ouichefs_file_index_block *index;
-		struct buffer_head *bh_index;
-		sector_t iblock;
+	if ((wronly || rdwr) && trunc && (inode->i_size != 0) &&
+	    ouichefs_is_inline(inode)) {
+		struct buffer_head *bh;
+		char *data;
 
-		/* Read index block from disk */
-		bh_index = sb_bread(sb, ci->index_block);
-		if (!bh_index)
+		bh = ouichefs_inline_bh(inode, &data);
+		if (!bh)
 			return -EIO;
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+		memset(data, 0, inode->i_size);
+		mark_buffer_dirty(bh);
+		brelse(bh);
 
-		for (iblock = 0; index->blocks[iblock] != 0; iblock++) {
-			put_block(sbi, index->blocks[iblock]);
-			index->blocks[iblock] = 0;
-		}
+		truncate_pagecache(inode, 0);
 		inode->i_size = 0;
-		inode->i_blocks = 0;
+		mark_inode_dirty(inode);
+	} else if ((wronly || rdwr) && trunc && (inode->i_size != 0)) {
+		int ret = ouichefs_truncate_blocks(inode, 0);
 
-		brelse(bh_index);
+		if (ret)
+			return ret;
+		inode->i_size = 0;
 	}
 	
 	return 0;
@@ -227,35 +596,47 @@ static ssize_t ouichefs_read(struct file *filep, char __user *buf, size_t len, l
 	//pr_info("Enter in ouichefs_read\n");
 	struct inode *inode = filep->f_inode;
 	struct super_block *sb = filep->f_inode->i_sb;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct ouichefs_file_index_block *index;
 	struct buffer_head *bh_index;
 	size_t bytes_to_read;
 	size_t bytes_not_read;
 	size_t bytes_read = 0;
 	sector_t iblock;
 	size_t offset;
+	uint32_t bno;
+	bool new;
+	int ret;
 
 	if (*ppos >= inode->i_size) {
 		return bytes_read;
 	}
 
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	if (ouichefs_is_inline(inode)) {
+		char *data;
 
-	iblock = *ppos / OUICHEFS_BLOCK_SIZE;
-	if (index->blocks[iblock] == 0) {
+		bh_index = ouichefs_inline_bh(inode, &data);
+		if (!bh_index)
+			return -EIO;
+		bytes_to_read = min_t(size_t, len, inode->i_size - *ppos);
+		if (copy_to_user(buf, data + *ppos, bytes_to_read)) {
+			brelse(bh_index);
+			return -EFAULT;
+		}
 		brelse(bh_index);
-		return bytes_read;
+		*ppos += bytes_to_read;
+		file_accessed(filep);
+		return bytes_to_read;
 	}
 
-	struct buffer_head *bh = sb_bread(sb, index->blocks[iblock]);
-	if (!bh) {
-		brelse(bh_index);
+	iblock = *ppos / OUICHEFS_BLOCK_SIZE;
+	ret = ouichefs_map_block(inode, iblock, false, &bno, &new);
+	if (ret)
+		return ret;
+	if (!bno)
+		return bytes_read;
+
+	struct buffer_head *bh = sb_bread(sb, bno);
+	if (!bh)
 		return -EIO;
-	}
 
 	offset = *ppos % OUICHEFS_BLOCK_SIZE;
 	size_t tmp = inode->i_size - *ppos;
@@ -263,7 +644,6 @@ static ssize_t ouichefs_read(struct file *filep, char __user *buf, size_t len, l
 	bytes_not_read = copy_to_user(buf, bh->b_data + offset, bytes_to_read);
 	if (bytes_not_read) {
 		brelse(bh);
-		brelse(bh_index);
 		return -EFAULT;
 	}
 
@@ -271,67 +651,115 @@ static ssize_t ouichefs_read(struct file *filep, char __user *buf, size_t len, l
 	*ppos += bytes_read;
 	
 	brelse(bh);
-	brelse(bh_index);
+
+	/* Honours the noatime/relatime/lazytime mount options */
+	file_accessed(filep);
 
 	//pr_info("Total bytes read: %ld\n", bytes_read);
 	return bytes_read;
 }
 
+/*
+ * Write len bytes from buf at pos in the content of the inline file inode, that
+ * fits inline. Called with the inode locked.
+ */
+static int ouichefs_write_inline(struct inode *inode, const char __user *buf,
+				 size_t len, loff_t pos)
+{
+	struct buffer_head *bh;
+	char *data;
+
+	bh = ouichefs_inline_bh(inode, &data);
+	if (!bh)
+		return -EIO;
+	/* Do not expose old data in a hole */
+	if (pos > inode->i_size)
+		memset(data + inode->i_size, 0, pos - inode->i_size);
+	if (copy_from_user(data + pos, buf, len)) {
+		brelse(bh);
+		return -EFAULT;
+	}
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	if (pos + len > inode->i_size) {
+		inode->i_size = pos + len;
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
 static ssize_t ouichefs_write(struct file *filep, const char __user *buf, size_t len, loff_t *ppos)
 {	
 	//pr_info("Enter in ouichefs_write\n");
 	struct inode *inode = filep->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh_index;
-	struct ouichefs_file_index_block *index;
 	size_t bytes_to_write; 
 	size_t bytes_write = 0;
 	size_t bytes_not_write;
 	sector_t iblock;
 	size_t offset;
 	size_t remaining;
-	int bno;
+	uint32_t bno;
+	bool new;
+	int ret;
 	
 	if (*ppos + len > OUICHEFS_MAX_FILESIZE)
 		return -ENOSPC;
 
-	uint32_t nr_allocs = max(*ppos + (unsigned int) len, inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > inode->i_blocks - 1)
-		nr_allocs -= inode->i_blocks - 1;
-	else
-		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
-		return -ENOSPC;
-
 	if (filep->f_flags && O_APPEND) {
 		*ppos = inode->i_size;
 	}
 
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
-	iblock = *ppos / OUICHEFS_BLOCK_SIZE;
-	if (index->blocks[iblock] == 0) {
-		bno = get_free_block(sbi);
-		if (!bno) {
-			brelse(bh_index);
-			return -ENOSPC;
+	/*
+	 * Timestamp-only updates mark the inode dirty for time only under the
+	 * lazytime mount option, so that they are written back in batches.
+	 */
+	ret = file_update_time(filep);
+	if (ret)
+		return ret;
+
+	/* The inline content and its conversion are protected by the inode lock */
+	inode_lock(inode);
+	if (ouichefs_is_inline(inode)) {
+		if (*ppos + len <= sbi->inline_size) {
+			ret = ouichefs_write_inline(inode, buf, len, *ppos);
+			inode_unlock(inode);
+			if (ret)
+				return ret;
+			*ppos += len;
+			return len;
 		}
-		index->blocks[iblock] = bno;
-		mark_buffer_dirty(bh_index);
-		sync_dirty_buffer(bh_index);
-	} else {
-		bno = index->blocks[iblock];
+		ret = ouichefs_convert_inline(inode);
 	}
-	
-	struct buffer_head *bh = sb_bread(sb, bno);
-	if (!bh) {
-		brelse(bh_index);
+	inode_unlock(inode);
+	if (ret)
+		return ret;
+
+	if (ouichefs_nr_allocs(inode, max_t(loff_t, *ppos + len,
+					    inode->i_size)) >
+	    sbi->nr_free_blocks)
+		return -ENOSPC;
+
+	iblock = *ppos / OUICHEFS_BLOCK_SIZE;
+	ret = ouichefs_map_block(inode, iblock, true, &bno, &new);
+	if (ret)
+		return ret;
+
+	/*
+	 * A new block is zeroed instead of read, so that the parts we do not
+	 * write do not expose what was left on disk.
+	 */
+	struct buffer_head *bh = new ? sb_getblk(sb, bno) : sb_bread(sb, bno);
+	if (!bh)
 		return -EIO;
+	if (new) {
+		lock_buffer(bh);
+		memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
 	}
 
 	offset = *ppos % OUICHEFS_BLOCK_SIZE;
@@ -341,7 +769,6 @@ static ssize_t ouichefs_write(struct file *filep, const char __user *buf, size_t
 	bytes_not_write = copy_from_user(bh->b_data + offset, buf, bytes_to_write);
 	if (bytes_not_write) {
 		brelse(bh);
-		brelse(bh_index);
 		return -EFAULT;
 	}
 	mark_buffer_dirty(bh);
@@ -352,27 +779,44 @@ static ssize_t ouichefs_write(struct file *filep, const char __user *buf, size_t
 
 	brelse(bh);
 
-	if (*ppos > inode->i_size)
+	if (*ppos > inode->i_size) {
 		inode->i_size = *ppos;
+		mark_inode_dirty(inode);
+	}
 
-	uint32_t nr_blocks_old = inode->i_blocks;
+	//pr_info("Total bytes write: %ld\n", bytes_write);
+	return bytes_write;
+}
 
-	inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
-	inode->i_mtime = inode->i_ctime = current_time(inode);
-	mark_inode_dirty(inode);
+/*
+ * Besides the data and the inode, write back what describes the blocks of the
+ * file: the index block, listed in the buffers of the inode, the inode store
+ * block holding the content of an inline file, and the bitmaps in which the
+ * blocks are allocated.
+ */
+static int ouichefs_fsync(struct file *file, loff_t start, loff_t end,
+			  int datasync)
+{
+	struct inode *inode = file_inode(file);
+	struct buffer_head *bh;
+	char *data;
+	int ret;
 
-	if (nr_blocks_old > inode->i_blocks) {
-		for (int i = inode->i_blocks - 1; i < nr_blocks_old - 1; i++) {
-			put_block(OUICHEFS_SB(sb), index->blocks[i]);
-			index->blocks[i] = 0;
-		}
+	ret = generic_file_fsync(file, start, end, datasync);
+	if (ret)
+		return ret;
+
+	if (ouichefs_is_inline(inode)) {
+		bh = ouichefs_inline_bh(inode, &data);
+		if (!bh)
+			return -EIO;
+		ret = sync_dirty_buffer(bh);
+		brelse(bh);
+		if (ret)
+			return ret;
 	}
-	mark_buffer_dirty(bh_index);
-	sync_dirty_buffer(bh_index);
-	brelse(bh_index);
 
-	//pr_info("Total bytes write: %ld\n", bytes_write);
-	return bytes_write;
+	return ouichefs_sync_bitmaps(inode->i_sb);
 }
 
 const struct file_operations ouichefs_file_ops = {
@@ -382,5 +826,8 @@ const struct file_operations ouichefs_file_ops = {
 	.write = ouichefs_write,
 	.llseek = generic_file_llseek,
 	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter
+	.write_iter = generic_file_write_iter,
+	.fsync = ouichefs_fsync,
+	.unlocked_ioctl = ouichefs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl
 };
\ No newline at end of file
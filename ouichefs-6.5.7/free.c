@@ -0,0 +1,547 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/workqueue.h>
+#include <linux/sched/signal.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Blocks waiting to be released. bno is either the first of count contiguous
+ * blocks, the index block of a regular file (OUICHEFS_FREE_INDEX) or the dx
+ * block of a large directory (OUICHEFS_FREE_DX), whose listed blocks are
+ * released along with it.
+ */
+struct ouichefs_free_req {
+	struct list_head list;
+	uint32_t bno;
+	uint32_t count;
+	unsigned int flags;
+};
+
+#define OUICHEFS_FREE_INDEX 0x1 /* bno is a file index block */
+#define OUICHEFS_FREE_SCRUB 0x2 /* apply the scrub policy to the blocks */
+#define OUICHEFS_FREE_DX 0x4 /* bno is the dx block of a large directory */
+
+/*
+ * Released extents are batched, then sorted and merged, so that contiguous
+ * blocks freed by different requests are discarded and given back to the
+ * bitmap with a single operation.
+ */
+#define OUICHEFS_FREE_BATCH 256
+
+struct ouichefs_extent {
+	uint32_t start;
+	uint32_t len;
+	bool discard; /* discard the extent before releasing it */
+};
+
+struct ouichefs_free_batch {
+	struct ouichefs_extent *ext;
+	int nr;
+	int max;
+};
+
+/* Largest run of free blocks kept out of the bitmap by FITRIM at a time */
+#define OUICHEFS_TRIM_CHUNK 8192 /* 32 MiB */
+
+#define BLK_TO_SECT(sb, blk) \
+	((sector_t)(blk) << ((sb)->s_blocksize_bits - SECTOR_SHIFT))
+
+static int cmp_bno(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int issue_discard(struct super_block *sb, uint32_t bno, uint32_t count)
+{
+	return blkdev_issue_discard(sb->s_bdev, BLK_TO_SECT(sb, bno),
+				    BLK_TO_SECT(sb, count), GFP_NOFS);
+}
+
+/*
+ * Zero a block in the buffer cache. The block is fully overwritten, so there
+ * is no need to read it from disk first.
+ */
+static void scrub_block(struct super_block *sb, uint32_t bno)
+{
+	struct buffer_head *bh;
+
+	bh = sb_getblk(sb, bno);
+	if (!bh)
+		return;
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+}
+
+/*
+ * Drop the cached copy of count blocks starting at bno, if any, before they
+ * are erased behind the buffer cache: a dirty buffer would overwrite the
+ * erased block and a clean one would be returned instead of the new content.
+ */
+static void forget_blocks(struct super_block *sb, uint32_t bno,
+			  uint32_t count)
+{
+	struct buffer_head *bh;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		bh = sb_find_get_block(sb, bno + i);
+		if (!bh)
+			continue;
+		lock_buffer(bh);
+		clear_buffer_dirty(bh);
+		clear_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		brelse(bh);
+	}
+}
+
+/*
+ * Erase count contiguous blocks starting at bno, according to the scrub policy
+ * of the filesystem. Discard and zeroout are issued as a single range request.
+ */
+static void scrub_blocks(struct super_block *sb, uint32_t bno, uint32_t count)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t i;
+	int ret = 0;
+
+	switch (sbi->scrub) {
+	case OUICHEFS_SCRUB_NONE:
+		return;
+	case OUICHEFS_SCRUB_DISCARD:
+		forget_blocks(sb, bno, count);
+		ret = issue_discard(sb, bno, count);
+		break;
+	case OUICHEFS_SCRUB_ZEROOUT:
+		forget_blocks(sb, bno, count);
+		ret = blkdev_issue_zeroout(sb->s_bdev, BLK_TO_SECT(sb, bno),
+					   BLK_TO_SECT(sb, count), GFP_NOFS, 0);
+		break;
+	case OUICHEFS_SCRUB_BUFFERED:
+		for (i = 0; i < count; i++)
+			scrub_block(sb, bno + i);
+		break;
+	}
+
+	if (ret)
+		pr_warn("failed to scrub blocks %u-%u (%d)\n", bno,
+			bno + count - 1, ret);
+}
+
+static int cmp_extent(const void *a, const void *b)
+{
+	const struct ouichefs_extent *x = a, *y = b;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Sort and merge the extents of batch, discard those that need it and give
+ * them back to the free blocks bitmap.
+ */
+static void flush_batch(struct super_block *sb, struct ouichefs_free_batch *b)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_extent *ext = b->ext, *cur;
+	int i, ret;
+
+	if (!b->nr)
+		return;
+
+	sort(ext, b->nr, sizeof(*ext), cmp_extent, NULL);
+	for (i = 0; i < b->nr; i++) {
+		cur = &ext[i];
+		while (i + 1 < b->nr && ext[i + 1].discard == cur->discard &&
+		       ext[i + 1].start == cur->start + cur->len) {
+			cur->len += ext[i + 1].len;
+			i++;
+		}
+
+		if (cur->discard) {
+			ret = issue_discard(sb, cur->start, cur->len);
+			if (ret && ret != -EOPNOTSUPP)
+				pr_warn("failed to discard blocks %u-%u (%d)\n",
+					cur->start, cur->start + cur->len - 1,
+					ret);
+		}
+		put_blocks(sbi, cur->start, cur->len);
+	}
+	b->nr = 0;
+}
+
+static void batch_add(struct super_block *sb, struct ouichefs_free_batch *b,
+		      uint32_t start, uint32_t len, bool discard)
+{
+	if (b->nr == b->max)
+		flush_batch(sb, b);
+
+	b->ext[b->nr].start = start;
+	b->ext[b->nr].len = len;
+	b->ext[b->nr].discard = discard;
+	b->nr++;
+}
+
+/*
+ * Scrub count blocks starting at bno if asked to, and add them to the batch.
+ * With the discard mount option, blocks that were not already erased by the
+ * scrub policy are discarded when the batch is flushed.
+ */
+static void release_blocks(struct super_block *sb,
+			   struct ouichefs_free_batch *b, uint32_t bno,
+			   uint32_t count, bool scrub)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	bool discard = sbi->discard;
+
+	if (scrub) {
+		scrub_blocks(sb, bno, count);
+		if (sbi->scrub != OUICHEFS_SCRUB_NONE)
+			discard = false;
+	}
+	batch_add(sb, b, bno, count, discard);
+}
+
+/*
+ * Release the data blocks listed in index block bno, then bno itself. Blocks
+ * are scrubbed before being released, so that nobody can allocate them while
+ * they still hold the data of the deleted file. The list is sorted in place so
+ * that contiguous blocks are scrubbed with a single request. If we fail to
+ * read the index block, release it anyway and lose its data blocks.
+ */
+static void free_index_block(struct super_block *sb,
+			     struct ouichefs_free_batch *b, uint32_t bno,
+			     bool scrub)
+{
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	int nr_entries = OUICHEFS_BLOCK_SIZE >> 2;
+	int i, end;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		goto release_index;
+	index = (struct ouichefs_file_index_block *)bh->b_data;
+
+	sort(index->blocks, nr_entries, sizeof(uint32_t), cmp_bno, NULL);
+	for (i = 0; i < nr_entries; i = end) {
+		end = i + 1;
+		if (!index->blocks[i])
+			continue;
+		while (end < nr_entries &&
+		       index->blocks[end] == index->blocks[end - 1] + 1)
+			end++;
+
+		release_blocks(sb, b, index->blocks[i], end - i, scrub);
+	}
+	brelse(bh);
+
+release_index:
+	release_blocks(sb, b, bno, 1, scrub);
+}
+
+/*
+ * Release the leaves listed in dx block bno, then bno itself. If we fail to
+ * read the dx block, release it anyway and lose its leaves.
+ */
+static void free_dx_block(struct super_block *sb, struct ouichefs_free_batch *b,
+			  uint32_t bno, bool scrub)
+{
+	struct ouichefs_dx_block *dx;
+	struct buffer_head *bh;
+	uint32_t i;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		goto release_dx;
+	dx = (struct ouichefs_dx_block *)bh->b_data;
+
+	for (i = 0; i < dx->nr_leaves && i < OUICHEFS_DX_LEAVES; i++)
+		release_blocks(sb, b, dx->leaves[i].block, 1, scrub);
+	brelse(bh);
+
+release_dx:
+	release_blocks(sb, b, bno, 1, scrub);
+}
+
+static void free_req(struct super_block *sb, struct ouichefs_free_batch *b,
+		     struct ouichefs_free_req *req)
+{
+	bool scrub = req->flags & OUICHEFS_FREE_SCRUB;
+
+	if (req->flags & OUICHEFS_FREE_INDEX)
+		free_index_block(sb, b, req->bno, scrub);
+	else if (req->flags & OUICHEFS_FREE_DX)
+		free_dx_block(sb, b, req->bno, scrub);
+	else
+		release_blocks(sb, b, req->bno, req->count, scrub);
+}
+
+static void ouichefs_free_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, free_work);
+	struct ouichefs_free_req *req, *tmp;
+	struct ouichefs_extent stack_ext[8];
+	struct ouichefs_free_batch batch;
+	LIST_HEAD(list);
+
+	batch.nr = 0;
+	batch.max = OUICHEFS_FREE_BATCH;
+	batch.ext = kmalloc_array(batch.max, sizeof(*batch.ext), GFP_NOFS);
+	if (!batch.ext) {
+		batch.ext = stack_ext;
+		batch.max = ARRAY_SIZE(stack_ext);
+	}
+
+	spin_lock(&sbi->free_lock);
+	list_splice_init(&sbi->free_list, &list);
+	spin_unlock(&sbi->free_lock);
+
+	list_for_each_entry_safe(req, tmp, &list, list) {
+		free_req(sbi->sb, &batch, req);
+		list_del(&req->list);
+		kfree(req);
+		cond_resched();
+	}
+	flush_batch(sbi->sb, &batch);
+
+	if (batch.ext != stack_ext)
+		kfree(batch.ext);
+}
+
+/*
+ * Add a request to the free queue. If we cannot allocate it, release the
+ * blocks synchronously.
+ */
+static void queue_req(struct super_block *sb, uint32_t bno, uint32_t count,
+		      unsigned int flags)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_free_req *req;
+
+	req = kmalloc(sizeof(*req), GFP_NOFS);
+	if (!req) {
+		struct ouichefs_free_req sync_req = {
+			.bno = bno, .count = count, .flags = flags
+		};
+		struct ouichefs_extent ext[8];
+		struct ouichefs_free_batch batch = {
+			.ext = ext, .nr = 0, .max = ARRAY_SIZE(ext)
+		};
+
+		free_req(sb, &batch, &sync_req);
+		flush_batch(sb, &batch);
+		return;
+	}
+	req->bno = bno;
+	req->count = count;
+	req->flags = flags;
+
+	spin_lock(&sbi->free_lock);
+	list_add_tail(&req->list, &sbi->free_list);
+	spin_unlock(&sbi->free_lock);
+
+	queue_work(sbi->free_wq, &sbi->free_work);
+}
+
+/*
+ * Hand index_block, and the data blocks it lists for a regular file, over to
+ * the free queue. Blocks are scrubbed and released in the background.
+ */
+void ouichefs_queue_free(struct super_block *sb, uint32_t index_block,
+			 bool is_dir)
+{
+	unsigned int flags = OUICHEFS_FREE_SCRUB;
+
+	if (!is_dir)
+		flags |= OUICHEFS_FREE_INDEX;
+	queue_req(sb, index_block, 1, flags);
+}
+
+/*
+ * Hand the dx block of a large directory, and the leaves it lists, over to the
+ * free queue.
+ */
+void ouichefs_queue_free_dx(struct super_block *sb, uint32_t dx_block)
+{
+	queue_req(sb, dx_block, 1, OUICHEFS_FREE_DX | OUICHEFS_FREE_SCRUB);
+}
+
+/*
+ * Hand the nr blocks listed in blocks (direct blocks of a file) over to the
+ * free queue, skipping the 0 entries. Contiguous blocks are queued together.
+ */
+void ouichefs_queue_free_blocks(struct super_block *sb, const uint32_t *blocks,
+				int nr)
+{
+	int i, end;
+
+	for (i = 0; i < nr; i = end) {
+		end = i + 1;
+		if (!blocks[i])
+			continue;
+		while (end < nr && blocks[end] == blocks[end - 1] + 1)
+			end++;
+
+		queue_req(sb, blocks[i], end - i, OUICHEFS_FREE_SCRUB);
+	}
+}
+
+/*
+ * Release a block that is no longer used by a file (truncation). Without the
+ * discard mount option, the block is released at once. Otherwise it goes
+ * through the free queue so that it can be discarded along with its
+ * neighbours; consecutive blocks are merged in the last queued request.
+ */
+void ouichefs_free_block(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_free_req *last;
+
+	if (!sbi->discard) {
+		put_block(sbi, bno);
+		return;
+	}
+
+	spin_lock(&sbi->free_lock);
+	if (!list_empty(&sbi->free_list)) {
+		last = list_last_entry(&sbi->free_list,
+				       struct ouichefs_free_req, list);
+		if (!last->flags && last->bno + last->count == bno) {
+			last->count++;
+			spin_unlock(&sbi->free_lock);
+			return;
+		}
+	}
+	spin_unlock(&sbi->free_lock);
+
+	queue_req(sb, bno, 1, 0);
+}
+
+/*
+ * Discard the free blocks in the byte range given by FITRIM. Free runs shorter
+ * than range->minlen are skipped. Each run is marked busy in the free blocks
+ * bitmap while it is being discarded, so that it cannot be allocated and
+ * written in the meantime, without touching the bitmap blocks; runs are handled
+ * in chunks to keep that window short. The busy range is only one, so FITRIM
+ * calls are serialized. On return, range->len holds the number of bytes
+ * discarded.
+ */
+int ouichefs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint64_t start, end, minlen, trimmed = 0;
+	unsigned long first, last, count;
+	int ret = 0;
+
+	start = range->start >> sb->s_blocksize_bits;
+	minlen = max_t(uint64_t, 1,
+		       DIV_ROUND_UP(range->minlen, OUICHEFS_BLOCK_SIZE));
+	if (start >= sbi->nr_blocks || range->len < OUICHEFS_BLOCK_SIZE ||
+	    minlen > sbi->nr_blocks)
+		return -EINVAL;
+	end = start + (range->len >> sb->s_blocksize_bits);
+	if (end > sbi->nr_blocks || end < start)
+		end = sbi->nr_blocks;
+
+	/* Make sure the blocks of unlinked files are in the bitmap */
+	ouichefs_flush_free_queue(sb);
+
+	if (mutex_lock_interruptible(&sbi->trim_lock))
+		return -ERESTARTSYS;
+	while (start < end) {
+		mutex_lock(&sbi->bitmap_lock);
+		first = ouichefs_bitmap_find(&sbi->bfree_bitmap, start, end,
+					     true);
+		if (first >= end) {
+			mutex_unlock(&sbi->bitmap_lock);
+			break;
+		}
+		last = ouichefs_bitmap_find(&sbi->bfree_bitmap, first, end,
+					    false);
+		if (last - first < minlen) {
+			mutex_unlock(&sbi->bitmap_lock);
+			start = last;
+			continue;
+		}
+		count = min_t(unsigned long, last - first, OUICHEFS_TRIM_CHUNK);
+		sbi->bfree_bitmap.busy_start = first;
+		sbi->bfree_bitmap.busy_end = first + count;
+		mutex_unlock(&sbi->bitmap_lock);
+
+		ret = issue_discard(sb, first, count);
+
+		mutex_lock(&sbi->bitmap_lock);
+		sbi->bfree_bitmap.busy_start = sbi->bfree_bitmap.busy_end = 0;
+		mutex_unlock(&sbi->bitmap_lock);
+
+		if (ret)
+			break;
+		trimmed += count;
+		start = first + count;
+
+		if (fatal_signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+	mutex_unlock(&sbi->trim_lock);
+
+	range->len = trimmed << sb->s_blocksize_bits;
+	return ret;
+}
+
+/*
+ * Wait until all the queued blocks are back in the free blocks bitmap.
+ */
+void ouichefs_flush_free_queue(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	flush_work(&sbi->free_work);
+}
+
+int ouichefs_init_free_queue(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	spin_lock_init(&sbi->free_lock);
+	INIT_LIST_HEAD(&sbi->free_list);
+	INIT_WORK(&sbi->free_work, ouichefs_free_work);
+
+	sbi->free_wq = alloc_workqueue("ouichefs-free/%s", WQ_UNBOUND, 1,
+				       sb->s_id);
+	if (!sbi->free_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void ouichefs_destroy_free_queue(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	destroy_workqueue(sbi->free_wq);
+}
@@ -36,6 +36,13 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
  */
 void ouichefs_kill_sb(struct super_block *sb)
 {
+	/*
+	 * Detached directories hold inodes, reclaim them before the dentries
+	 * are shrunk and the inodes evicted. Without a root, fill_super failed
+	 * and already stopped the worker.
+	 */
+	if (sb->s_root)
+		ouichefs_destroy_rmtree(sb);
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
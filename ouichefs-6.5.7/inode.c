@@ -11,24 +11,79 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/namei.h>
+#include <linux/fsnotify.h>
+#include <linux/security.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
 
 static const struct inode_operations ouichefs_inode_ops;
 
+/*
+ * Fill inode with the content of its legacy on-disk version cinode.
+ */
+static void ouichefs_read_disk_inode(struct inode *inode,
+				     struct ouichefs_inode *cinode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	inode->i_mode = le32_to_cpu(cinode->i_mode);
+	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
+	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
+	inode->i_size = le32_to_cpu(cinode->i_size);
+	inode->i_ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
+	inode->i_ctime.tv_nsec = (long)le64_to_cpu(cinode->i_nctime);
+	inode->i_atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
+	inode->i_atime.tv_nsec = (long)le64_to_cpu(cinode->i_natime);
+	inode->i_mtime.tv_sec = (time64_t)le32_to_cpu(cinode->i_mtime);
+	inode->i_mtime.tv_nsec = (long)le64_to_cpu(cinode->i_nmtime);
+	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
+	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
+
+	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->i_flags = le32_to_cpu(cinode->i_flags);
+}
+
+/*
+ * Fill inode with the content of its version 2 on-disk version cinode.
+ */
+static void ouichefs_read_disk_inode_v2(struct inode *inode,
+					struct ouichefs_inode_v2 *cinode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	inode->i_mode = le16_to_cpu(cinode->i_mode);
+	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
+	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
+	inode->i_size = le32_to_cpu(cinode->i_size);
+	inode->i_ctime.tv_sec = (time64_t)le64_to_cpu(cinode->i_ctime);
+	inode->i_ctime.tv_nsec = (long)le32_to_cpu(cinode->i_nctime);
+	inode->i_atime.tv_sec = (time64_t)le64_to_cpu(cinode->i_atime);
+	inode->i_atime.tv_nsec = (long)le32_to_cpu(cinode->i_natime);
+	inode->i_mtime.tv_sec = (time64_t)le64_to_cpu(cinode->i_mtime);
+	inode->i_mtime.tv_nsec = (long)le32_to_cpu(cinode->i_nmtime);
+	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
+	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
+
+	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->i_flags = le16_to_cpu(cinode->i_flags);
+}
+
 /*
  * Get inode ino from disk.
  */
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 {
 	struct inode *inode = NULL;
-	struct ouichefs_inode *cinode = NULL;
 	struct ouichefs_inode_info *ci = NULL;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block = (ino / sbi->inodes_per_block) + 1;
+	uint32_t inode_shift = ino % sbi->inodes_per_block;
+	uint32_t first;
+	char *cinode;
 	int ret;
 
 	/* Fail if ino is out of range */
@@ -45,32 +100,44 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 
 	ci = OUICHEFS_INODE(inode);
 	/* Read inode from disk and initialize */
-	bh = sb_bread(sb, inode_block);
+	bh = sb_getblk(sb, inode_block);
 	if (!bh) {
 		ret = -EIO;
 		goto failed;
 	}
-	cinode = (struct ouichefs_inode *)bh->b_data;
-	cinode += inode_shift;
+	if (!buffer_uptodate(bh)) {
+		/*
+		 * Siblings are allocated in the same inode group (see
+		 * ouichefs_inode_goal()), read the whole group ahead.
+		 */
+		first = rounddown(ino, OUICHEFS_INODES_PER_GROUP(sbi)) /
+				sbi->inodes_per_block + 1;
+		ouichefs_readahead_blocks(sb, first,
+					  min_t(uint32_t, OUICHEFS_IGROUP_BLOCKS,
+						sbi->nr_istore_blocks + 1 -
+							first));
+		if (bh_read(bh, 0) < 0) {
+			ret = -EIO;
+			goto failed;
+		}
+	}
+	cinode = bh->b_data + inode_shift * sbi->inode_size;
 
 	inode->i_ino = ino;
 	inode->i_sb = sb;
 	inode->i_op = &ouichefs_inode_ops;
 
-	inode->i_mode = le32_to_cpu(cinode->i_mode);
-	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
-	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
-	inode->i_size = le32_to_cpu(cinode->i_size);
-	inode->i_ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
-	inode->i_ctime.tv_nsec = (long)le64_to_cpu(cinode->i_nctime);
-	inode->i_atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
-	inode->i_atime.tv_nsec = (long)le64_to_cpu(cinode->i_natime);
-	inode->i_mtime.tv_sec = (time64_t)le32_to_cpu(cinode->i_mtime);
-	inode->i_mtime.tv_nsec = (long)le64_to_cpu(cinode->i_nmtime);
-	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
-	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
-
-	ci->index_block = le32_to_cpu(cinode->index_block);
+	if (sbi->features & OUICHEFS_FEATURE_INODE_V2)
+		ouichefs_read_disk_inode_v2(
+			inode, (struct ouichefs_inode_v2 *)cinode);
+	else
+		ouichefs_read_disk_inode(inode,
+					 (struct ouichefs_inode *)cinode);
+	if (sbi->nr_direct && !(ci->i_flags & OUICHEFS_INODE_INLINE))
+		memcpy(ci->i_direct, OUICHEFS_INODE_DIRECT(sbi, cinode),
+		       sizeof(ci->i_direct));
+	else
+		memset(ci->i_direct, 0, sizeof(ci->i_direct));
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
@@ -100,40 +167,30 @@ failed:
 static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 				      unsigned int flags)
 {
-	struct super_block *sb = dir->i_sb;
-	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
 	struct inode *inode = NULL;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
+	uint32_t ino;
+	int ret;
 
 	/* Check filename length */
-	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
+	if (dentry->d_name.len > sbi->name_len)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return ERR_PTR(-EIO);
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
 	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!strncmp(f->filename, dentry->d_name.name,
-			     OUICHEFS_FILENAME_LEN)) {
-			inode = ouichefs_iget(sb, f->inode);
-			break;
-		}
+	ret = ouichefs_dir_find(dir, &dentry->d_name, &ino);
+	if (ret)
+		return ERR_PTR(ret);
+	if (ino) {
+		inode = ouichefs_iget(dir->i_sb, ino);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
 	}
-	brelse(bh);
 
-	/* Update directory access time */
-	dir->i_atime = current_time(dir);
-	mark_inode_dirty(dir);
+	/*
+	 * Do not update the directory access time: a lookup does not read the
+	 * directory. Listing it does, and the VFS then updates the access time
+	 * following the noatime/relatime/lazytime mount options.
+	 */
 
 	/* Fill the dentry with the inode */
 	d_add(dentry, inode);
@@ -142,9 +199,49 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 }
 
 /*
- * Create a new inode in dir.
+ * Return the inode number from which to look for a free inode (Orlov-style):
+ *   - a top-level directory goes to the inode group with the most free inodes,
+ *     starting the search from a random group, so that top-level subtrees are
+ *     spread over the inode store;
+ *   - any other inode goes right after its parent directory, so that the
+ *     children of a directory share a handful of inode store blocks.
+ */
+static uint32_t ouichefs_inode_goal(struct inode *dir, umode_t mode)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t nr_groups, start, group, nr_free, best = 0, best_free = 0;
+	uint32_t i;
+
+	if (!S_ISDIR(mode) || dir != d_inode(sb->s_root))
+		return rounddown(dir->i_ino, sbi->inodes_per_block);
+
+	nr_groups = DIV_ROUND_UP(sbi->nr_inodes, OUICHEFS_INODES_PER_GROUP(sbi));
+	start = get_random_u32_below(nr_groups);
+	for (i = 0; i < nr_groups; i++) {
+		group = (start + i) % nr_groups;
+		mutex_lock(&sbi->bitmap_lock);
+		nr_free = count_free_bits(&sbi->ifree_bitmap,
+					  group * OUICHEFS_INODES_PER_GROUP(sbi),
+					  OUICHEFS_INODES_PER_GROUP(sbi));
+		mutex_unlock(&sbi->bitmap_lock);
+		if (nr_free > best_free) {
+			best = group;
+			best_free = nr_free;
+		}
+		/* An empty group is as good as it gets */
+		if (nr_free == OUICHEFS_INODES_PER_GROUP(sbi))
+			break;
+	}
+
+	return best * OUICHEFS_INODES_PER_GROUP(sbi);
+}
+
+/*
+ * Create a new inode in dir, with the first free inode number from goal.
  */
-static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
+static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode,
+					uint32_t goal)
 {
 	struct inode *inode;
 	struct ouichefs_inode_info *ci;
@@ -166,7 +263,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
-	ino = get_free_inode(sbi);
+	ino = get_free_inode(sbi, goal);
 	if (!ino)
 		return ERR_PTR(-ENOSPC);
 	inode = ouichefs_iget(sb, ino);
@@ -175,18 +272,31 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		goto put_ino;
 	}
 	ci = OUICHEFS_INODE(inode);
-
-	/* Get a free block for this new inode's index */
-	bno = get_free_block(sbi);
-	if (!bno) {
-		ret = -ENOSPC;
-		goto put_inode;
-	}
-	ci->index_block = bno;
+	ci->i_flags = 0;
+	memset(ci->i_direct, 0, sizeof(ci->i_direct));
 
 	/* Initialize inode */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
 	inode->i_blocks = 1;
+
+	if (S_ISREG(mode) && sbi->inline_size) {
+		/* Regular files start inline, without any block */
+		ci->index_block = 0;
+		ci->i_flags |= OUICHEFS_INODE_INLINE;
+		inode->i_blocks = 0;
+	} else if (S_ISREG(mode) && sbi->nr_direct) {
+		/* The index block is allocated once direct blocks are used */
+		ci->index_block = 0;
+		inode->i_blocks = 0;
+	} else {
+		/* Get a free block for this new inode's index */
+		bno = get_free_block(sbi);
+		if (!bno) {
+			ret = -ENOSPC;
+			goto put_inode;
+		}
+		ci->index_block = bno;
+	}
 	if (S_ISDIR(mode)) {
 		inode->i_size = OUICHEFS_BLOCK_SIZE;
 		inode->i_fop = &ouichefs_dir_ops;
@@ -211,181 +321,142 @@ put_ino:
 }
 
 /*
- * Create a file or directory in this way:
- *   - check filename length and if the parent directory is not full
- *   - create the new inode (allocate inode and blocks)
- *   - cleanup index block of the new inode
- *   - add new file/directory in parent index
+ * Scrub the index block of the new inode to avoid previous data messing with
+ * the new file, or initialize the new directory. Inline files have none.
  */
-static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
-			   struct dentry *dentry, umode_t mode, bool excl)
+static int ouichefs_init_new_inode(struct inode *inode)
 {
-	struct super_block *sb;
-	struct inode *inode;
-	struct ouichefs_inode_info *ci_dir;
-	struct ouichefs_dir_block *dblock;
-	char *fblock;
-	struct buffer_head *bh, *bh2;
-	int ret = 0, i;
+	uint32_t bno = OUICHEFS_INODE(inode)->index_block;
+	struct buffer_head *bh;
 
-	/* Check filename length */
-	if (strlen(dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
-		return -ENAMETOOLONG;
+	if (S_ISDIR(inode->i_mode))
+		return ouichefs_dir_init(inode);
+	if (!bno)
+		return 0;
 
-	/* Read parent directory index */
-	ci_dir = OUICHEFS_INODE(dir);
-	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
+	bh = sb_bread(inode->i_sb, bno);
 	if (!bh)
 		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	mark_buffer_dirty(bh);
+	brelse(bh);
 
-	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		ret = -EMLINK;
-		goto end;
-	}
+	return 0;
+}
 
-	/* Get a new free inode */
-	inode = ouichefs_new_inode(dir, mode);
-	if (IS_ERR(inode)) {
-		ret = PTR_ERR(inode);
-		goto end;
-	}
+/*
+ * Give back the inode number and the index block of a new inode that could not
+ * be used, and drop it.
+ */
+static void ouichefs_put_new_inode(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
 
-	/*
-	 * Scrub index_block for new file/directory to avoid previous data
-	 * messing with new file/directory.
-	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh2) {
-		ret = -EIO;
-		goto iput;
-	}
-	fblock = (char *)bh2->b_data;
-	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
-	brelse(bh2);
-
-	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
-		if (dblock->files[i].inode == 0)
-			break;
-	dblock->files[i].inode = inode->i_ino;
-	strscpy(dblock->files[i].filename, dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	if (OUICHEFS_INODE(inode)->index_block)
+		put_block(sbi, OUICHEFS_INODE(inode)->index_block);
+	put_inode(sbi, inode->i_ino);
+	iput(inode);
+}
+
+/*
+ * Create a file or directory in this way:
+ *   - create the new inode (allocate inode and blocks), from inode goal
+ *   - cleanup index block of the new inode, or initialize the new directory
+ *   - add new file/directory in parent index, if it is not full
+ * The caller updates dir itself.
+ */
+static int ouichefs_create_entry(struct inode *dir, struct dentry *dentry,
+				 umode_t mode, uint32_t goal)
+{
+	struct inode *inode;
+	int ret;
 
-	/* Update stats and mark dir and new inode dirty */
+	/* Get a new free inode */
+	inode = ouichefs_new_inode(dir, mode, goal);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	ret = ouichefs_init_new_inode(inode);
+	if (ret)
+		goto put;
+
+	/* Register new inode in parent directory, fails if it is full */
+	ret = ouichefs_dir_add(dir, &dentry->d_name, inode);
+	if (ret)
+		goto put;
 	mark_inode_dirty(inode);
-	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
-	if (S_ISDIR(mode))
-		inode_inc_link_count(dir);
-	mark_inode_dirty(dir);
 
 	/* setup dentry */
 	d_instantiate(dentry, inode);
 
 	return 0;
 
-iput:
-	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
-	put_inode(OUICHEFS_SB(sb), inode->i_ino);
-	iput(inode);
-end:
-	brelse(bh);
+put:
+	ouichefs_put_new_inode(inode);
 	return ret;
 }
 
+static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
+			   struct dentry *dentry, umode_t mode, bool excl)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	int ret;
+
+	/* Check filename length */
+	if (dentry->d_name.len > sbi->name_len)
+		return -ENAMETOOLONG;
+
+	ret = ouichefs_create_entry(dir, dentry, mode,
+				    ouichefs_inode_goal(dir, mode));
+	if (ret)
+		return ret;
+
+	/* Update stats and mark dir dirty */
+	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+	if (S_ISDIR(mode))
+		inode_inc_link_count(dir);
+	mark_inode_dirty(dir);
+
+	return 0;
+}
+
 /*
- * Remove a link for a file. If link count is 0, destroy file in this way:
- *   - remove the file from its parent directory.
- *   - cleanup blocks containing data
- *   - cleanup file index block
+ * Destroy inode, whose last directory entry was removed, in this way:
+ *   - queue the file direct blocks, index block and the data blocks it lists
+ *     for freeing
  *   - cleanup inode
  */
-static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+void ouichefs_release_inode(struct inode *inode)
 {
-	struct super_block *sb = dir->i_sb;
+	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
-	int i, f_id = -1, nr_subs = 0;
 
 	ino = inode->i_ino;
 	bno = OUICHEFS_INODE(inode)->index_block;
 
-	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
-	if (!bh)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
-	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
-	brelse(bh);
-
-	/* Update inode stats */
-	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
-	if (S_ISDIR(inode->i_mode))
-		inode_dec_link_count(dir);
-	mark_inode_dirty(dir);
-
 	/*
-	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
-	 * index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block, don't fail (too late
-	 * anyway), just put the block and continue.
+	 * Detach the direct blocks and the index block from the inode. They are
+	 * scrubbed and released, along with the data blocks listed in the index
+	 * block of a regular file, in the background.
 	 */
-	bh = sb_bread(sb, bno);
-	if (!bh)
-		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
+	ouichefs_queue_free_blocks(sb, OUICHEFS_INODE(inode)->i_direct,
+				   OUICHEFS_NR_DIRECT);
+	if (OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_INDEXED)
+		ouichefs_queue_free_dx(sb, bno);
+	else if (bno)
+		ouichefs_queue_free(sb, bno, S_ISDIR(inode->i_mode));
+
+	/* The in-memory inode may be reused for the same inode number */
 	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-	}
-
-scrub:
-	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
-	brelse(bh);
+		ouichefs_ncache_drop(inode);
 
-clean_inode:
 	/* Cleanup inode and mark dirty */
 	inode->i_blocks = 0;
 	OUICHEFS_INODE(inode)->index_block = 0;
+	memset(OUICHEFS_INODE(inode)->i_direct, 0,
+	       sizeof(OUICHEFS_INODE(inode)->i_direct));
+	OUICHEFS_INODE(inode)->i_flags = 0;
 	inode->i_size = 0;
 	i_uid_write(inode, 0);
 	i_gid_write(inode, 0);
@@ -394,12 +465,47 @@ clean_inode:
 		0;
 	inode->i_ctime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_atime.tv_nsec =
 		0;
-	inode_dec_link_count(inode);
+	/* An orphan inode has no link left */
+	if (inode->i_nlink)
+		drop_nlink(inode);
 	mark_inode_dirty(inode);
 
-	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
+	/* Free inode from bitmap */
 	put_inode(sbi, ino);
+}
+
+/*
+ * Remove a link for a file: remove the file from its parent directory, then
+ * destroy it. The caller updates dir itself.
+ */
+static int ouichefs_unlink_entry(struct inode *dir, struct dentry *dentry)
+{
+	int ret;
+
+	/* Remove file from parent directory */
+	ret = ouichefs_dir_remove(dir, &dentry->d_name);
+	if (ret)
+		return ret;
+
+	ouichefs_release_inode(d_inode(dentry));
+
+	return 0;
+}
+
+static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	bool is_dir = S_ISDIR(d_inode(dentry)->i_mode);
+	int ret;
+
+	ret = ouichefs_unlink_entry(dir, dentry);
+	if (ret)
+		return ret;
+
+	/* Update inode stats */
+	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
+	if (is_dir)
+		inode_dec_link_count(dir);
+	mark_inode_dirty(dir);
 
 	return 0;
 }
@@ -408,65 +514,44 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 			   struct dentry *old_dentry, struct inode *new_dir,
 			   struct dentry *new_dentry, unsigned int flags)
 {
-	struct super_block *sb = old_dir->i_sb;
-	struct ouichefs_inode_info *ci_old = OUICHEFS_INODE(old_dir);
-	struct ouichefs_inode_info *ci_new = OUICHEFS_INODE(new_dir);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(old_dir->i_sb);
 	struct inode *src = d_inode(old_dentry);
-	struct buffer_head *bh_old = NULL, *bh_new = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
+	uint32_t ino;
+	int ret;
 
 	/* fail with these unsupported flags */
 	if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
 		return -EINVAL;
 
 	/* Check if filename is not too long */
-	if (strlen(new_dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
+	if (new_dentry->d_name.len > sbi->name_len)
 		return -ENAMETOOLONG;
 
-	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
-	if (!bh_new)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		/* if old_dir == new_dir, save the renamed file position */
-		if (new_dir == old_dir) {
-			if (strncmp(dir_block->files[i].filename,
-				    old_dentry->d_name.name,
-				    OUICHEFS_FILENAME_LEN) == 0)
-				f_pos = i;
-		}
-		if (strncmp(dir_block->files[i].filename,
-			    new_dentry->d_name.name,
-			    OUICHEFS_FILENAME_LEN) == 0) {
-			ret = -EEXIST;
-			goto relse_new;
-		}
-		if (new_pos < 0 && dir_block->files[i].inode == 0)
-			new_pos = i;
-	}
-	/* if old_dir == new_dir, just rename entry */
-	if (old_dir == new_dir) {
-		strscpy(dir_block->files[f_pos].filename,
-			new_dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
-		goto relse_new;
-	}
+	/* Fail if new_dentry exists */
+	ret = ouichefs_dir_find(new_dir, &new_dentry->d_name, &ino);
+	if (ret)
+		return ret;
+	if (ino)
+		return -EEXIST;
 
-	/* If new directory is empty, fail */
-	if (new_pos < 0) {
-		ret = -EMLINK;
-		goto relse_new;
+	/*
+	 * if old_dir == new_dir, just rename entry. A longer name may not fit in
+	 * the room of the old one: put the old entry back if so, it fits.
+	 */
+	if (old_dir == new_dir) {
+		ret = ouichefs_dir_remove(old_dir, &old_dentry->d_name);
+		if (ret)
+			return ret;
+		ret = ouichefs_dir_add(new_dir, &new_dentry->d_name, src);
+		if (ret)
+			ouichefs_dir_add(old_dir, &old_dentry->d_name, src);
+		return ret;
 	}
 
-	/* insert in new parent directory */
-	dir_block->files[new_pos].inode = src->i_ino;
-	strscpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
-	brelse(bh_new);
+	/* insert in new parent directory, fails if it is full */
+	ret = ouichefs_dir_add(new_dir, &new_dentry->d_name, src);
+	if (ret)
+		return ret;
 
 	/* Update new parent inode metadata */
 	new_dir->i_atime = new_dir->i_ctime = new_dir->i_mtime =
@@ -476,26 +561,9 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	mark_inode_dirty(new_dir);
 
 	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
-	if (!bh_old)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
-	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == src->i_ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
-	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
-	brelse(bh_old);
+	ret = ouichefs_dir_remove(old_dir, &old_dentry->d_name);
+	if (ret)
+		return ret;
 
 	/* Update old parent inode metadata */
 	old_dir->i_atime = old_dir->i_ctime = old_dir->i_mtime =
@@ -505,12 +573,75 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	mark_inode_dirty(old_dir);
 
 	return 0;
+}
 
-relse_new:
-	brelse(bh_new);
+/*
+ * Create an unnamed regular file (O_TMPFILE). Its data never goes through a
+ * directory block. It is listed in the orphan table until it is given a name
+ * with linkat(), so that it is reclaimed at the next mount after a crash.
+ */
+static int ouichefs_tmpfile(struct mnt_idmap *idmap, struct inode *dir,
+			    struct file *file, umode_t mode)
+{
+	struct inode *inode;
+	int ret;
+
+	inode = ouichefs_new_inode(dir, mode, ouichefs_inode_goal(dir, mode));
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	ret = ouichefs_init_new_inode(inode);
+	if (ret)
+		goto put;
+	ret = ouichefs_orphan_add(inode);
+	if (ret)
+		goto put;
+
+	/* Drops the link count to 0 */
+	d_tmpfile(file, inode);
+
+	return finish_open_simple(file, 0);
+
+put:
+	ouichefs_put_new_inode(inode);
 	return ret;
 }
 
+/*
+ * Give a name to a file created with O_TMPFILE. Other hard links are not
+ * supported: a file is destroyed when any of its names is unlinked.
+ */
+static int ouichefs_link(struct dentry *old_dentry, struct inode *dir,
+			 struct dentry *dentry)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct inode *inode = d_inode(old_dentry);
+	int ret;
+
+	if (inode->i_nlink)
+		return -EPERM;
+	if (dentry->d_name.len > sbi->name_len)
+		return -ENAMETOOLONG;
+
+	ret = ouichefs_dir_add(dir, &dentry->d_name, inode);
+	if (ret)
+		return ret;
+
+	/* The file is no longer an orphan once it has a name */
+	inc_nlink(inode);
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	ouichefs_orphan_del(inode);
+
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+
+	ihold(inode);
+	d_instantiate(dentry, inode);
+
+	return 0;
+}
+
 static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 			  struct dentry *dentry, umode_t mode)
 {
@@ -519,33 +650,208 @@ static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 
 static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct super_block *sb = dir->i_sb;
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh;
-	struct ouichefs_dir_block *dblock;
+	int ret;
 
 	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-	if (dblock->files[0].inode != 0) {
-		brelse(bh);
+	ret = ouichefs_dir_empty(inode);
+	if (ret < 0)
+		return ret;
+	if (!ret)
 		return -ENOTEMPTY;
-	}
-	brelse(bh);
 
 	/* Remove directory with unlink */
 	return ouichefs_unlink(dir, dentry);
 }
 
+/*
+ * Return the next name of a batch, its length in *len, and move *names past
+ * it. Return NULL if the batch does not hold another NUL-terminated name.
+ */
+static const char *ouichefs_bulk_next(const char **names, const char *end,
+				      unsigned int *len)
+{
+	const char *name = *names;
+	size_t n = strnlen(name, end - name);
+
+	if (n == end - name)
+		return NULL;
+	*names += n + 1;
+	*len = n;
+
+	return name;
+}
+
+/* Checks done once for a whole batch, dir being locked */
+static int ouichefs_bulk_begin(struct mnt_idmap *idmap, struct inode *dir)
+{
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+	if (IS_DEADDIR(dir))
+		return -ENOENT;
+
+	return inode_permission(idmap, dir, MAY_WRITE | MAY_EXEC);
+}
+
+/*
+ * Create count empty regular files in the directory of file, named after the
+ * NUL-terminated strings packed in the size bytes of names. The directory is
+ * locked and checked once, the new inodes are allocated one after the other,
+ * and the directory inode is updated once. Stop at the first failure, *done
+ * being the number of files created.
+ */
+int ouichefs_bulk_create(struct file *file, const char *names, size_t size,
+			 unsigned int count, umode_t mode, unsigned int *done)
+{
+	struct mnt_idmap *idmap = file_mnt_idmap(file);
+	struct dentry *parent = file->f_path.dentry;
+	struct inode *dir = d_inode(parent);
+	const char *end = names + size, *name;
+	struct dentry *dentry;
+	unsigned int len;
+	uint32_t goal;
+	int ret;
+
+	mode = (mode & S_IRWXUGO & ~current_umask()) | S_IFREG;
+	*done = 0;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	ret = ouichefs_bulk_begin(idmap, dir);
+	if (ret)
+		goto unlock;
+
+	goal = ouichefs_inode_goal(dir, mode);
+	for (; *done < count; (*done)++) {
+		name = ouichefs_bulk_next(&names, end, &len);
+		if (!name) {
+			ret = -EINVAL;
+			break;
+		}
+		dentry = lookup_one(idmap, name, parent, len);
+		if (IS_ERR(dentry)) {
+			ret = PTR_ERR(dentry);
+			break;
+		}
+		if (d_really_is_positive(dentry))
+			ret = -EEXIST;
+		else
+			ret = security_inode_create(dir, dentry, mode);
+		if (!ret)
+			ret = ouichefs_create_entry(dir, dentry, mode, goal);
+		if (!ret) {
+			fsnotify_create(dir, dentry);
+			/* Keep the batch in as few inode store blocks as we can */
+			goal = d_inode(dentry)->i_ino + 1;
+		}
+		dput(dentry);
+		if (ret)
+			break;
+	}
+
+	if (*done) {
+		dir->i_mtime = dir->i_ctime = current_time(dir);
+		mark_inode_dirty(dir);
+	}
+unlock:
+	inode_unlock(dir);
+
+	return ret;
+}
+
+/* The checks of vfs_unlink() on a regular file of a batch */
+static int ouichefs_bulk_may_unlink(struct mnt_idmap *idmap,
+				    struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+
+	if (d_really_is_negative(dentry))
+		return -ENOENT;
+	if (d_is_dir(dentry))
+		return -EISDIR;
+	if (check_sticky(idmap, dir, inode) || IS_APPEND(dir) ||
+	    IS_APPEND(inode) || IS_IMMUTABLE(inode) || IS_SWAPFILE(inode))
+		return -EPERM;
+	if (d_mountpoint(dentry))
+		return -EBUSY;
+
+	return 0;
+}
+
+/*
+ * Unlink count regular files from the directory of file, named after the
+ * NUL-terminated strings packed in the size bytes of names, the same way as
+ * ouichefs_bulk_create() creates them. Stop at the first failure, *done being
+ * the number of files unlinked.
+ */
+int ouichefs_bulk_unlink(struct file *file, const char *names, size_t size,
+			 unsigned int count, unsigned int *done)
+{
+	struct mnt_idmap *idmap = file_mnt_idmap(file);
+	struct dentry *parent = file->f_path.dentry;
+	struct inode *dir = d_inode(parent);
+	const char *end = names + size, *name;
+	struct dentry *dentry;
+	struct inode *inode;
+	unsigned int len;
+	int ret;
+
+	*done = 0;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	ret = ouichefs_bulk_begin(idmap, dir);
+	if (ret)
+		goto unlock;
+
+	for (; *done < count; (*done)++) {
+		name = ouichefs_bulk_next(&names, end, &len);
+		if (!name) {
+			ret = -EINVAL;
+			break;
+		}
+		dentry = lookup_one(idmap, name, parent, len);
+		if (IS_ERR(dentry)) {
+			ret = PTR_ERR(dentry);
+			break;
+		}
+		ret = ouichefs_bulk_may_unlink(idmap, dir, dentry);
+		if (!ret) {
+			inode = d_inode(dentry);
+			inode_lock(inode);
+			ret = try_break_deleg(inode, NULL);
+			if (!ret)
+				ret = security_inode_unlink(dir, dentry);
+			if (!ret)
+				ret = ouichefs_unlink_entry(dir, dentry);
+			if (!ret)
+				dont_mount(dentry);
+			inode_unlock(inode);
+			if (!ret)
+				d_delete_notify(dir, dentry);
+		}
+		dput(dentry);
+		if (ret)
+			break;
+	}
+
+	if (*done) {
+		dir->i_mtime = dir->i_ctime = current_time(dir);
+		mark_inode_dirty(dir);
+	}
+unlock:
+	inode_unlock(dir);
+
+	return ret;
+}
+
 static const struct inode_operations ouichefs_inode_ops = {
 	.lookup = ouichefs_lookup,
 	.create = ouichefs_create,
+	.link = ouichefs_link,
 	.unlink = ouichefs_unlink,
 	.mkdir = ouichefs_mkdir,
 	.rmdir = ouichefs_rmdir,
 	.rename = ouichefs_rename,
+	.tmpfile = ouichefs_tmpfile,
 };
@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+
+#include "ouichefs.h"
+
+/*
+ * FITRIM: discard the free blocks of the filesystem in a given range.
+ */
+static long ouichefs_ioctl_fitrim(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct fstrim_range range;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!bdev_max_discard_sectors(sb->s_bdev))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(u64, range.minlen,
+			     bdev_discard_granularity(sb->s_bdev));
+	ret = ouichefs_trim_fs(sb, &range);
+	if (ret < 0)
+		return ret;
+
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Largest buffer filled by one READDIRPLUS call */
+#define OUICHEFS_READDIRPLUS_MAX (64 << 10)
+
+/* Records of a READDIRPLUS call, filled in two passes */
+struct ouichefs_rdp {
+	struct dir_context ctx;
+	char *buf; /* Records */
+	uint32_t size; /* Size of buf */
+	uint32_t used; /* Bytes of buf used */
+	bool full; /* buf has no room for the next record */
+	unsigned int nr; /* Number of records */
+	struct ouichefs_rdp_ent {
+		uint32_t ino;
+		uint32_t off; /* Offset of the record in buf */
+	} *ents;
+};
+
+/*
+ * First pass, as the actor of a readdir() of the directory: copy the names,
+ * stop when buf is full.
+ */
+static bool ouichefs_rdp_fill(struct dir_context *ctx, const char *name,
+			      int len, loff_t pos, u64 ino, unsigned int type)
+{
+	struct ouichefs_rdp *rdp = container_of(ctx, struct ouichefs_rdp, ctx);
+	struct ouichefs_direntplus *de;
+	unsigned int rec_len = OUICHEFS_DIRENTPLUS_LEN(len);
+
+	if (rdp->used + rec_len > rdp->size) {
+		rdp->full = true;
+		return false;
+	}
+
+	de = (struct ouichefs_direntplus *)(rdp->buf + rdp->used);
+	memset(de, 0, rec_len);
+	de->ino = ino;
+	de->rec_len = rec_len;
+	de->name_len = len;
+	memcpy(de->name, name, len);
+
+	rdp->ents[rdp->nr].ino = ino;
+	rdp->ents[rdp->nr].off = rdp->used;
+	rdp->nr++;
+	rdp->used += rec_len;
+
+	return true;
+}
+
+static int cmp_rdp_ino(const void *a, const void *b)
+{
+	uint32_t ia = ((const struct ouichefs_rdp_ent *)a)->ino;
+	uint32_t ib = ((const struct ouichefs_rdp_ent *)b)->ino;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+static void ouichefs_rdp_from_inode(struct ouichefs_direntplus *de,
+				    struct inode *inode)
+{
+	de->size = i_size_read(inode);
+	de->mtime = inode->i_mtime.tv_sec;
+	de->mtime_nsec = inode->i_mtime.tv_nsec;
+	de->mode = inode->i_mode;
+	de->uid = from_kuid_munged(current_user_ns(), inode->i_uid);
+	de->gid = from_kgid_munged(current_user_ns(), inode->i_gid);
+	de->nlink = inode->i_nlink;
+}
+
+static void ouichefs_rdp_from_disk(struct ouichefs_direntplus *de,
+				   struct super_block *sb, char *cinode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_v2 *v2 = (struct ouichefs_inode_v2 *)cinode;
+	struct ouichefs_inode *v1 = (struct ouichefs_inode *)cinode;
+	uint32_t uid, gid;
+
+	if (sbi->features & OUICHEFS_FEATURE_INODE_V2) {
+		de->size = le32_to_cpu(v2->i_size);
+		de->mtime = le64_to_cpu(v2->i_mtime);
+		de->mtime_nsec = le32_to_cpu(v2->i_nmtime);
+		de->mode = le16_to_cpu(v2->i_mode);
+		de->nlink = le32_to_cpu(v2->i_nlink);
+		uid = le32_to_cpu(v2->i_uid);
+		gid = le32_to_cpu(v2->i_gid);
+	} else {
+		de->size = le32_to_cpu(v1->i_size);
+		de->mtime = le32_to_cpu(v1->i_mtime);
+		de->mtime_nsec = le64_to_cpu(v1->i_nmtime);
+		de->mode = le32_to_cpu(v1->i_mode);
+		de->nlink = le32_to_cpu(v1->i_nlink);
+		uid = le32_to_cpu(v1->i_uid);
+		gid = le32_to_cpu(v1->i_gid);
+	}
+	de->uid = from_kuid_munged(current_user_ns(),
+				   make_kuid(sb->s_user_ns, uid));
+	de->gid = from_kgid_munged(current_user_ns(),
+				   make_kgid(sb->s_user_ns, gid));
+}
+
+/*
+ * Second pass: fill the attributes of the records. Inodes in the inode cache
+ * are up to date, the others are read from the inode store. Records are
+ * visited by inode number, so that each inode store block is read once, all
+ * the reads being submitted first under one plug.
+ */
+static int ouichefs_rdp_attrs(struct super_block *sb, struct ouichefs_rdp *rdp)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_direntplus *de;
+	struct buffer_head *bh = NULL;
+	struct blk_plug plug;
+	struct inode *inode;
+	uint32_t ino, blk, last = 0;
+	unsigned int i;
+
+	sort(rdp->ents, rdp->nr, sizeof(*rdp->ents), cmp_rdp_ino, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < rdp->nr; i++) {
+		blk = rdp->ents[i].ino / sbi->inodes_per_block + 1;
+		if (blk != last && rdp->ents[i].ino < sbi->nr_inodes)
+			sb_breadahead(sb, blk);
+		last = blk;
+	}
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < rdp->nr; i++) {
+		ino = rdp->ents[i].ino;
+		de = (struct ouichefs_direntplus *)(rdp->buf +
+						    rdp->ents[i].off);
+
+		inode = ilookup(sb, ino);
+		if (inode) {
+			ouichefs_rdp_from_inode(de, inode);
+			iput(inode);
+			continue;
+		}
+
+		if (ino >= sbi->nr_inodes) {
+			brelse(bh);
+			return -EIO;
+		}
+		blk = ino / sbi->inodes_per_block + 1;
+		if (!bh || bh->b_blocknr != blk) {
+			brelse(bh);
+			bh = sb_bread(sb, blk);
+			if (!bh)
+				return -EIO;
+		}
+		ouichefs_rdp_from_disk(de, sb,
+				       bh->b_data + (ino % sbi->inodes_per_block) *
+							    sbi->inode_size);
+	}
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * OUICHEFS_IOC_READDIRPLUS: list a directory with the attributes of its
+ * entries, saving a stat() per entry. Entries are listed as by readdir(),
+ * without . and .., and pos is a readdir() position.
+ */
+static long ouichefs_ioctl_readdirplus(struct file *file, void __user *arg)
+{
+	struct inode *dir = file_inode(file);
+	struct ouichefs_readdirplus args;
+	struct ouichefs_rdp rdp = {
+		.ctx.actor = ouichefs_rdp_fill,
+	};
+	int ret;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+	/* The attributes of the entries are only visible to who may stat() them */
+	ret = inode_permission(file_mnt_idmap(file), dir, MAY_EXEC);
+	if (ret)
+		return ret;
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+
+	rdp.size = min_t(uint32_t, args.size, OUICHEFS_READDIRPLUS_MAX);
+	if (rdp.size < OUICHEFS_DIRENTPLUS_LEN(1))
+		return -EINVAL;
+	/* Skip . and .. */
+	rdp.ctx.pos = clamp_t(uint64_t, args.pos, 2, LLONG_MAX);
+	rdp.buf = kvmalloc(rdp.size, GFP_KERNEL);
+	rdp.ents = kvmalloc_array(rdp.size / OUICHEFS_DIRENTPLUS_LEN(1),
+				  sizeof(*rdp.ents), GFP_KERNEL);
+	if (!rdp.buf || !rdp.ents) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	inode_lock_shared(dir);
+	if (IS_DEADDIR(dir)) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+	ret = ouichefs_iterate(file, &rdp.ctx);
+	if (ret < 0)
+		goto unlock;
+	/* The buffer cannot even hold the next entry */
+	if (rdp.full && !rdp.nr) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	ret = ouichefs_rdp_attrs(dir->i_sb, &rdp);
+	if (ret)
+		goto unlock;
+	file_accessed(file);
+	inode_unlock_shared(dir);
+
+	if (copy_to_user(u64_to_user_ptr(args.buf), rdp.buf, rdp.used)) {
+		ret = -EFAULT;
+		goto free;
+	}
+	args.count = rdp.nr;
+	args.pos = rdp.ctx.pos;
+	if (copy_to_user(arg, &args, sizeof(args)))
+		ret = -EFAULT;
+	goto free;
+
+unlock:
+	inode_unlock_shared(dir);
+free:
+	kvfree(rdp.ents);
+	kvfree(rdp.buf);
+
+	return ret;
+}
+
+/*
+ * OUICHEFS_IOC_BULK_CREATE and OUICHEFS_IOC_BULK_UNLINK: create or unlink a
+ * batch of regular files in a directory, see ouichefs_bulk_create().
+ */
+static long ouichefs_ioctl_bulk(struct file *file, void __user *arg,
+				bool create)
+{
+	struct ouichefs_bulk args;
+	char *names;
+	int ret;
+
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	if (args.size > OUICHEFS_BULK_MAX)
+		return -E2BIG;
+
+	names = vmemdup_user(u64_to_user_ptr(args.names), args.size);
+	if (IS_ERR(names))
+		return PTR_ERR(names);
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		goto free;
+	if (create)
+		ret = ouichefs_bulk_create(file, names, args.size, args.count,
+					   args.mode, &args.done);
+	else
+		ret = ouichefs_bulk_unlink(file, names, args.size, args.count,
+					   &args.done);
+	mnt_drop_write_file(file);
+
+	if (copy_to_user(arg, &args, sizeof(args)))
+		ret = -EFAULT;
+free:
+	kvfree(names);
+
+	return ret;
+}
+
+/*
+ * OUICHEFS_IOC_RMTREE: remove a directory tree, see ouichefs_rmtree().
+ */
+static long ouichefs_ioctl_rmtree(struct file *file, void __user *arg)
+{
+	struct ouichefs_rmtree args;
+	char *name;
+	int ret;
+
+	if (copy_from_user(&args, arg, sizeof(args)))
+		return -EFAULT;
+	name = strndup_user(u64_to_user_ptr(args.name), OUICHEFS_NAME_LEN + 1);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	ret = mnt_want_write_file(file);
+	if (!ret) {
+		ret = ouichefs_rmtree(file, name);
+		mnt_drop_write_file(file);
+	}
+	kfree(name);
+
+	return ret;
+}
+
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case FITRIM:
+		return ouichefs_ioctl_fitrim(file, (void __user *)arg);
+	case OUICHEFS_IOC_READDIRPLUS:
+		return ouichefs_ioctl_readdirplus(file, (void __user *)arg);
+	case OUICHEFS_IOC_BULK_CREATE:
+		return ouichefs_ioctl_bulk(file, (void __user *)arg, true);
+	case OUICHEFS_IOC_BULK_UNLINK:
+		return ouichefs_ioctl_bulk(file, (void __user *)arg, false);
+	case OUICHEFS_IOC_RMTREE:
+		return ouichefs_ioctl_rmtree(file, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -18,6 +18,9 @@
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
 
+#define OUICHEFS_SUMMARY_RUNS 32
+#define OUICHEFS_STATE_CLEAN 1
+
 struct ouichefs_inode {
 	mode_t i_mode; /* File mode */
 	uint32_t i_uid; /* Owner id */
@@ -32,10 +35,37 @@ struct ouichefs_inode {
 	uint32_t i_blocks; /* Block count (subdir count for directories) */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_flags; /* Inode flags */
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+/* Version 2 inode: 64 bytes, naturally aligned, 64-bit timestamps */
+struct ouichefs_inode_v2 {
+	uint64_t i_ctime; /* Inode change time (sec) */
+	uint64_t i_atime; /* Access time (sec) */
+	uint64_t i_mtime; /* Modification time (sec) */
+	uint32_t i_nctime; /* Inode change time (nsec) */
+	uint32_t i_natime; /* Access time (nsec) */
+	uint32_t i_nmtime; /* Modification time (nsec) */
+	uint16_t i_mode; /* File mode */
+	uint16_t i_flags; /* Inode flags */
+	uint32_t i_uid; /* Owner id */
+	uint32_t i_gid; /* Group id */
+	uint32_t i_size; /* Size in bytes */
+	uint32_t i_blocks; /* Block count */
+	uint32_t i_nlink; /* Hard links count */
+	uint32_t index_block; /* Block with list of blocks for this file */
+};
+
+#define OUICHEFS_FEATURE_INLINE_DATA 0x1
+#define OUICHEFS_FEATURE_DIRECT_BLOCKS 0x2
+#define OUICHEFS_FEATURE_INODE_V2 0x4
+#define OUICHEFS_FEATURE_HASHED_DIRS 0x8
+#define OUICHEFS_FEATURE_LARGE_DIRS 0x10
+#define OUICHEFS_FEATURE_SPARSE_DIRS 0x20
+
+#define OUICHEFS_NR_DIRECT 12
+
+#define OUICHEFS_NR_ORPHANS 128
 
 struct ouichefs_superblock {
 	uint32_t magic; /* Magic number */
@@ -50,7 +80,17 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	char padding[4064]; /* Padding to match block size */
+	uint32_t state; /* Clean or dirty */
+	struct ouichefs_free_run {
+		uint32_t start; /* First free block */
+		uint32_t len; /* Number of free blocks */
+	} free_runs[OUICHEFS_SUMMARY_RUNS];
+
+	uint32_t inode_size; /* Size of an inode store slot */
+	uint32_t features; /* Optional format features */
+	uint32_t orphans[OUICHEFS_NR_ORPHANS]; /* Orphan inodes, none at first */
+
+	char padding[3284]; /* Padding to match block size */
 };
 
 struct ouichefs_file_index_block {
@@ -64,12 +104,35 @@ struct ouichefs_dir_block {
 	} files[OUICHEFS_MAX_SUBFILES];
 };
 
+struct ouichefs_dirent {
+	uint32_t inode;
+	uint32_t hash;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+};
+
 static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
-		appname);
+		"%s [-H] [-v version] [-i inode_size] disk\n"
+		"\n"
+		"  -H             hashed directories: entries carry a hash of their\n"
+		"                 name to speed up lookups, names are up to 255\n"
+		"                 bytes long, and full directories grow to an\n"
+		"                 index of up to 511 blocks.\n"
+		"  -v version     on-disk inode format: 1 (default) or 2, a compact\n"
+		"                 %zu-byte inode with 64-bit timestamps.\n"
+		"  -i inode_size  size of an inode in bytes (default %zu, or %zu\n"
+		"                 with version 2, where it must be a power of 2).\n"
+		"                 The room left after the inode stores the data of\n"
+		"                 small files, or the first blocks of larger files\n"
+		"                 if there is room for %d block numbers.\n",
+		appname, sizeof(struct ouichefs_inode_v2),
+		sizeof(struct ouichefs_inode), sizeof(struct ouichefs_inode_v2),
+		OUICHEFS_NR_DIRECT);
 }
 
 /* Returns ceil(a/b) */
@@ -81,8 +144,14 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 	return ret;
 }
 
-static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
+static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats,
+						    uint32_t inode_size,
+						    int version, int hashed_dirs)
 {
+	size_t hdr_size = version == 2 ? sizeof(struct ouichefs_inode_v2) :
+					 sizeof(struct ouichefs_inode);
+	uint32_t inodes_per_block = OUICHEFS_BLOCK_SIZE / inode_size;
+	uint32_t features;
 	int ret;
 	struct ouichefs_superblock *sb;
 	uint32_t nr_inodes = 0, nr_blocks = 0, nr_ifree_blocks = 0;
@@ -95,10 +164,10 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 
 	nr_blocks = fstats->st_size / OUICHEFS_BLOCK_SIZE;
 	nr_inodes = nr_blocks;
-	mod = nr_inodes % OUICHEFS_INODES_PER_BLOCK;
+	mod = nr_inodes % inodes_per_block;
 	if (mod != 0)
 		nr_inodes += mod;
-	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
+	nr_istore_blocks = idiv_ceil(nr_inodes, inodes_per_block);
 	nr_ifree_blocks = idiv_ceil(nr_inodes, OUICHEFS_BLOCK_SIZE * 8);
 	nr_bfree_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE * 8);
 	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks -
@@ -113,6 +182,27 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
+	sb->inode_size = htole32(inode_size);
+	/* Room left after the inode holds the data of small files */
+	features = version == 2 ? OUICHEFS_FEATURE_INODE_V2 : 0;
+	if (hashed_dirs) {
+		features |= OUICHEFS_FEATURE_HASHED_DIRS |
+			    OUICHEFS_FEATURE_LARGE_DIRS;
+	} else {
+		/* Removing an entry leaves a hole instead of moving the others */
+		features |= OUICHEFS_FEATURE_SPARSE_DIRS;
+	}
+	if (inode_size > hdr_size)
+		features |= OUICHEFS_FEATURE_INLINE_DATA;
+	/* ... or the direct block pointers of larger ones, when it fits */
+	if (inode_size >= hdr_size + OUICHEFS_NR_DIRECT * sizeof(uint32_t))
+		features |= OUICHEFS_FEATURE_DIRECT_BLOCKS;
+	sb->features = htole32(features);
+
+	/* All the data blocks but the root directory's are one free run */
+	sb->state = htole32(OUICHEFS_STATE_CLEAN);
+	sb->free_runs[0].start = htole32(nr_blocks - nr_data_blocks + 1);
+	sb->free_runs[0].len = htole32(nr_data_blocks - 1);
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
@@ -127,10 +217,13 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tinode_size=%u\n"
+	       "\tfeatures=%#x\n",
 	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
 	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
-	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks);
+	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks,
+	       sb->inode_size, sb->features);
 
 	return sb;
 }
@@ -140,8 +233,11 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	int ret = 0;
 	uint32_t i;
 	struct ouichefs_inode *inode;
+	struct ouichefs_inode_v2 *inode_v2;
 	char *block;
 	uint32_t first_data_block;
+	mode_t mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
+		      S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH;
 
 	/* Allocate a zeroed block for inode store */
 	block = malloc(OUICHEFS_BLOCK_SIZE);
@@ -150,21 +246,30 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	memset(block, 0, OUICHEFS_BLOCK_SIZE);
 
 	/* Root inode (inode 1) */
-	inode = (struct ouichefs_inode *)block + 1;
 	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
 			   le32toh(sb->nr_istore_blocks);
-	inode->i_mode =
-		htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
-			S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
-	inode->i_uid = 0;
-	inode->i_gid = 0;
-	inode->i_size = htole32(OUICHEFS_BLOCK_SIZE);
-	inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
-	inode->i_nctime = inode->i_natime = inode->i_nmtime = htole64(0);
-	inode->i_blocks = htole32(1);
-	inode->i_nlink = htole32(2);
-	inode->index_block = htole32(first_data_block);
+	if (le32toh(sb->features) & OUICHEFS_FEATURE_INODE_V2) {
+		inode_v2 = (struct ouichefs_inode_v2 *)(block +
+							le32toh(sb->inode_size));
+		inode_v2->i_mode = htole16(mode);
+		inode_v2->i_size = htole32(OUICHEFS_BLOCK_SIZE);
+		inode_v2->i_blocks = htole32(1);
+		inode_v2->i_nlink = htole32(2);
+		inode_v2->index_block = htole32(first_data_block);
+	} else {
+		inode = (struct ouichefs_inode *)(block +
+						  le32toh(sb->inode_size));
+		inode->i_mode = htole32(mode);
+		inode->i_uid = 0;
+		inode->i_gid = 0;
+		inode->i_size = htole32(OUICHEFS_BLOCK_SIZE);
+		inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
+		inode->i_nctime = inode->i_natime = inode->i_nmtime = htole64(0);
+		inode->i_blocks = htole32(1);
+		inode->i_nlink = htole32(2);
+		inode->index_block = htole32(first_data_block);
+	}
 
 	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
 	if (ret != OUICHEFS_BLOCK_SIZE) {
@@ -184,8 +289,8 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	ret = 0;
 
 	printf("Inode store: wrote %d blocks\n"
-	       "\tinode size = %ld B\n",
-	       i, sizeof(struct ouichefs_inode));
+	       "\tinode size = %u B\n",
+	       i, le32toh(sb->inode_size));
 
 end:
 	free(block);
@@ -292,6 +397,7 @@ end:
 
 static int write_root_index_block(int fd, struct ouichefs_superblock *sb)
 {
+	struct ouichefs_dirent *de;
 	int ret = 0;
 	char *block;
 
@@ -300,6 +406,12 @@ static int write_root_index_block(int fd, struct ouichefs_superblock *sb)
 		return -1;
 	memset(block, 0, OUICHEFS_BLOCK_SIZE);
 
+	/* A hashed directory is a chain of records, start with a free one */
+	if (le32toh(sb->features) & OUICHEFS_FEATURE_HASHED_DIRS) {
+		de = (struct ouichefs_dirent *)block;
+		de->rec_len = OUICHEFS_BLOCK_SIZE;
+	}
+
 	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
 	if (ret != OUICHEFS_BLOCK_SIZE) {
 		ret = -1;
@@ -340,14 +452,59 @@ int main(int argc, char **argv)
 	long int min_size;
 	struct stat stat_buf;
 	struct ouichefs_superblock *sb = NULL;
-
-	if (argc != 2 || argv[1][0] == '-') {
+	unsigned long inode_size = 0;
+	size_t hdr_size;
+	int version = 1, hashed_dirs = 0;
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "Hi:v:")) != -1) {
+		switch (opt) {
+		case 'H':
+			hashed_dirs = 1;
+			break;
+		case 'i':
+			inode_size = strtoul(optarg, &end, 0);
+			if (*end || !inode_size) {
+				fprintf(stderr, "Invalid inode size %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			version = strtol(optarg, &end, 0);
+			if (*end || (version != 1 && version != 2)) {
+				fprintf(stderr, "Invalid inode version %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
+	/* Check the inode size against the inode format */
+	hdr_size = version == 2 ? sizeof(struct ouichefs_inode_v2) :
+				  sizeof(struct ouichefs_inode);
+	if (!inode_size)
+		inode_size = hdr_size;
+	if (inode_size < hdr_size || inode_size > OUICHEFS_BLOCK_SIZE ||
+	    (version == 2 && (inode_size & (inode_size - 1)))) {
+		fprintf(stderr,
+			"Invalid inode size %lu (min %zu, max %d%s)\n",
+			inode_size, hdr_size, OUICHEFS_BLOCK_SIZE,
+			version == 2 ? ", power of 2" : "");
+		return EXIT_FAILURE;
+	}
+
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
@@ -372,7 +529,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
+	sb = write_superblock(fd, &stat_buf, inode_size, version, hashed_dirs);
 	if (!sb) {
 		perror("write_superblock():");
 		ret = EXIT_FAILURE;
@@ -0,0 +1,334 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/shrinker.h>
+
+#include "ouichefs.h"
+
+/*
+ * Name index of a directory: a hash table of all its entries, built from disk
+ * by the first lookup and kept up to date by the directory functions. While a
+ * directory has one, lookups are answered from memory, including those of
+ * names that are not in the directory. Indexes are listed in the LRU list of
+ * the filesystem, and dropped by its shrinker under memory pressure.
+ */
+struct ouichefs_ncache_entry {
+	struct hlist_node node;
+	struct ouichefs_dir_slot slot;
+	uint32_t hash; /* ouichefs_name_hash() of name */
+	uint8_t len;
+	char name[];
+};
+
+struct ouichefs_ncache {
+	struct list_head dispose; /* Used by the shrinker */
+	unsigned long nr; /* Number of entries */
+	unsigned int bits; /* log2 of the number of buckets */
+	struct hlist_head buckets[];
+};
+
+#define OUICHEFS_NCACHE_MIN_BITS 4
+#define OUICHEFS_NCACHE_MAX_BITS 16
+
+static struct ouichefs_ncache_entry *ncache_lookup(struct ouichefs_ncache *nc,
+						   const char *name,
+						   unsigned int len,
+						   uint32_t hash)
+{
+	struct ouichefs_ncache_entry *e;
+
+	hlist_for_each_entry(e, &nc->buckets[hash_32(hash, nc->bits)], node) {
+		if (e->hash == hash && e->len == len &&
+		    !memcmp(e->name, name, len))
+			return e;
+	}
+
+	return NULL;
+}
+
+static int ncache_insert(void *data, const char *name, unsigned int len,
+			 uint32_t hash, const struct ouichefs_dir_slot *slot)
+{
+	struct ouichefs_ncache *nc = data;
+	struct ouichefs_ncache_entry *e;
+
+	e = kmalloc(struct_size(e, name, len), GFP_KERNEL);
+	if (!e)
+		return -ENOMEM;
+	e->slot = *slot;
+	e->hash = hash;
+	e->len = len;
+	memcpy(e->name, name, len);
+	hlist_add_head(&e->node, &nc->buckets[hash_32(hash, nc->bits)]);
+	nc->nr++;
+
+	return 0;
+}
+
+static void ncache_free(struct ouichefs_ncache *nc)
+{
+	struct ouichefs_ncache_entry *e;
+	struct hlist_node *tmp;
+	unsigned long i;
+
+	for (i = 0; i < (1UL << nc->bits); i++) {
+		hlist_for_each_entry_safe(e, tmp, &nc->buckets[i], node)
+			kfree(e);
+	}
+	kvfree(nc);
+}
+
+/*
+ * Build the index of dir from disk. The table is sized for the largest number
+ * of short names dir can hold, and is not resized afterwards.
+ */
+static struct ouichefs_ncache *ncache_build(struct inode *dir)
+{
+	struct ouichefs_ncache *nc;
+	unsigned int bits;
+
+	bits = clamp_t(unsigned int, order_base_2(dir->i_size / 64),
+		       OUICHEFS_NCACHE_MIN_BITS, OUICHEFS_NCACHE_MAX_BITS);
+	nc = kvzalloc(struct_size(nc, buckets, 1UL << bits), GFP_KERNEL);
+	if (!nc)
+		return NULL;
+	nc->bits = bits;
+
+	if (ouichefs_dir_scan(dir, ncache_insert, nc)) {
+		ncache_free(nc);
+		return NULL;
+	}
+
+	return nc;
+}
+
+/*
+ * Detach the index of dir, whose i_ncache_lock is held, and return it.
+ *
+ * ncache_lock is taken even if the shrinker already took the index away: the
+ * shrinker releases i_ncache_lock under ncache_lock, so taking it waits for
+ * the shrinker to be done with the mutex before the inode can be freed.
+ */
+static struct ouichefs_ncache *ncache_detach(struct inode *dir)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_ncache *nc = ci->i_ncache;
+
+	spin_lock(&sbi->ncache_lock);
+	list_del_init(&ci->i_ncache_lru);
+	spin_unlock(&sbi->ncache_lock);
+	if (nc) {
+		atomic_long_sub(nc->nr, &sbi->ncache_nr);
+		ci->i_ncache = NULL;
+	}
+
+	return nc;
+}
+
+/*
+ * Look for name in the index of dir, building it first if needed. Return true
+ * and fill *slot if the index could be used, slot->ino being 0 if name is not
+ * in dir. Return false if there is no index (e.g., no memory to build it).
+ */
+bool ouichefs_ncache_find(struct inode *dir, const struct qstr *name,
+			  uint32_t hash, struct ouichefs_dir_slot *slot)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_ncache_entry *e;
+	bool ret = true;
+
+	mutex_lock(&ci->i_ncache_lock);
+	if (!ci->i_ncache) {
+		ci->i_ncache = ncache_build(dir);
+		if (!ci->i_ncache) {
+			ret = false;
+			goto unlock;
+		}
+		atomic_long_add(ci->i_ncache->nr, &sbi->ncache_nr);
+		spin_lock(&sbi->ncache_lock);
+		list_add(&ci->i_ncache_lru, &sbi->ncache_lru);
+		spin_unlock(&sbi->ncache_lock);
+	}
+	WRITE_ONCE(ci->i_ncache_ref, true);
+
+	e = ncache_lookup(ci->i_ncache, name->name, name->len, hash);
+	if (e) {
+		*slot = e->slot;
+	} else {
+		slot->ino = 0;
+		slot->bno = 0;
+	}
+
+unlock:
+	mutex_unlock(&ci->i_ncache_lock);
+	return ret;
+}
+
+/*
+ * Record the new entry name of dir in its index, if it has one. The index is
+ * dropped if the entry cannot be added, as it would no longer be complete.
+ */
+void ouichefs_ncache_add(struct inode *dir, const struct qstr *name,
+			 uint32_t hash, const struct ouichefs_dir_slot *slot)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_ncache *nc = NULL;
+
+	mutex_lock(&ci->i_ncache_lock);
+	if (ci->i_ncache) {
+		if (ncache_insert(ci->i_ncache, name->name, name->len, hash,
+				  slot))
+			nc = ncache_detach(dir);
+		else
+			atomic_long_inc(&sbi->ncache_nr);
+	}
+	mutex_unlock(&ci->i_ncache_lock);
+
+	if (nc)
+		ncache_free(nc);
+}
+
+/*
+ * Forget the removed entry name of dir.
+ */
+void ouichefs_ncache_remove(struct inode *dir, const struct qstr *name,
+			    uint32_t hash)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_ncache_entry *e;
+
+	mutex_lock(&ci->i_ncache_lock);
+	if (ci->i_ncache) {
+		e = ncache_lookup(ci->i_ncache, name->name, name->len, hash);
+		if (e) {
+			hlist_del(&e->node);
+			kfree(e);
+			ci->i_ncache->nr--;
+			atomic_long_dec(&sbi->ncache_nr);
+		}
+	}
+	mutex_unlock(&ci->i_ncache_lock);
+}
+
+/*
+ * Record that the entry name of dir moved to block bno.
+ */
+void ouichefs_ncache_move(struct inode *dir, const char *name,
+			  unsigned int len, uint32_t hash, uint32_t bno)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_ncache_entry *e;
+
+	mutex_lock(&ci->i_ncache_lock);
+	if (ci->i_ncache) {
+		e = ncache_lookup(ci->i_ncache, name, len, hash);
+		if (e)
+			e->slot.bno = bno;
+	}
+	mutex_unlock(&ci->i_ncache_lock);
+}
+
+/*
+ * Free the index of dir, if any. Called when the inode is destroyed.
+ */
+void ouichefs_ncache_drop(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_ncache *nc;
+
+	mutex_lock(&ci->i_ncache_lock);
+	nc = ncache_detach(dir);
+	mutex_unlock(&ci->i_ncache_lock);
+
+	if (nc)
+		ncache_free(nc);
+}
+
+static unsigned long ouichefs_ncache_count(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, ncache_shrinker);
+
+	return atomic_long_read(&sbi->ncache_nr);
+}
+
+/*
+ * Drop whole indexes from the cold end of the LRU list until nr_to_scan
+ * entries are freed. An index used since the last scan is given a second
+ * chance, as is one whose directory is busy.
+ */
+static unsigned long ouichefs_ncache_scan(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, ncache_shrinker);
+	struct ouichefs_ncache *nc, *tmp;
+	struct ouichefs_inode_info *ci;
+	unsigned long freed = 0, scanned = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&sbi->ncache_lock);
+	while (freed < sc->nr_to_scan && scanned++ < sc->nr_to_scan &&
+	       !list_empty(&sbi->ncache_lru)) {
+		ci = list_last_entry(&sbi->ncache_lru,
+				     struct ouichefs_inode_info, i_ncache_lru);
+		if (READ_ONCE(ci->i_ncache_ref) ||
+		    !mutex_trylock(&ci->i_ncache_lock)) {
+			WRITE_ONCE(ci->i_ncache_ref, false);
+			list_move(&ci->i_ncache_lru, &sbi->ncache_lru);
+			continue;
+		}
+		nc = ci->i_ncache;
+		ci->i_ncache = NULL;
+		list_del_init(&ci->i_ncache_lru);
+		mutex_unlock(&ci->i_ncache_lock);
+
+		atomic_long_sub(nc->nr, &sbi->ncache_nr);
+		freed += nc->nr;
+		list_add(&nc->dispose, &dispose);
+	}
+	spin_unlock(&sbi->ncache_lock);
+
+	list_for_each_entry_safe(nc, tmp, &dispose, dispose)
+		ncache_free(nc);
+
+	return freed;
+}
+
+int ouichefs_register_ncache_shrinker(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	INIT_LIST_HEAD(&sbi->ncache_lru);
+	spin_lock_init(&sbi->ncache_lock);
+	atomic_long_set(&sbi->ncache_nr, 0);
+	sbi->ncache_shrinker.count_objects = ouichefs_ncache_count;
+	sbi->ncache_shrinker.scan_objects = ouichefs_ncache_scan;
+	sbi->ncache_shrinker.seeks = DEFAULT_SEEKS;
+
+	return register_shrinker(&sbi->ncache_shrinker, "ouichefs-ncache:%s",
+				 sb->s_id);
+}
+
+void ouichefs_unregister_ncache_shrinker(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	unregister_shrinker(&sbi->ncache_shrinker);
+}
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+
+#include "ouichefs.h"
+
+/*
+ * Orphan table: inodes without any directory entry that must live until their
+ * last reference is dropped, i.e. files created with O_TMPFILE and not linked
+ * yet. The table is updated in place in the superblock buffer, and written back
+ * with it. At mount, the inodes it still lists were left by a crash and are
+ * reclaimed.
+ */
+
+/* Set slot i of the orphan table of the superblock in bh to ino */
+static void ouichefs_orphan_set(struct buffer_head *bh, int i, uint32_t ino)
+{
+	struct ouichefs_superblock *disk_sb =
+		(struct ouichefs_superblock *)bh->b_data;
+
+	lock_buffer(bh);
+	disk_sb->orphans[i] = ino;
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+}
+
+/*
+ * List inode in the orphan table. Return -ENOSPC if the table is full.
+ */
+int ouichefs_orphan_add(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_superblock *disk_sb;
+	struct buffer_head *bh;
+	int i, ret = -ENOSPC;
+
+	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh)
+		return -EIO;
+	disk_sb = (struct ouichefs_superblock *)bh->b_data;
+
+	mutex_lock(&sbi->orphan_lock);
+	for (i = 0; i < OUICHEFS_NR_ORPHANS; i++) {
+		if (disk_sb->orphans[i])
+			continue;
+		ouichefs_orphan_set(bh, i, inode->i_ino);
+		OUICHEFS_INODE(inode)->i_orphan = i;
+		ret = 0;
+		break;
+	}
+	mutex_unlock(&sbi->orphan_lock);
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Take inode off the orphan table, if it is listed.
+ */
+void ouichefs_orphan_del(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+
+	if (ci->i_orphan < 0)
+		return;
+
+	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh) {
+		pr_err("unable to remove inode %lu from the orphan table\n",
+		       inode->i_ino);
+		return;
+	}
+	mutex_lock(&sbi->orphan_lock);
+	ouichefs_orphan_set(bh, ci->i_orphan, 0);
+	ci->i_orphan = -1;
+	mutex_unlock(&sbi->orphan_lock);
+	brelse(bh);
+}
+
+/*
+ * Reclaim the inodes left in the orphan table by a crash. An inode that was
+ * given a name or already destroyed before the crash, but whose removal from
+ * the table was not written back, is only taken off the table.
+ */
+void ouichefs_orphan_recover(struct super_block *sb)
+{
+	struct ouichefs_superblock *disk_sb;
+	struct buffer_head *bh;
+	struct inode *inode;
+	unsigned int nr = 0;
+	uint32_t ino;
+	int i;
+
+	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+	if (!bh) {
+		pr_err("unable to read the orphan table\n");
+		return;
+	}
+	disk_sb = (struct ouichefs_superblock *)bh->b_data;
+
+	for (i = 0; i < OUICHEFS_NR_ORPHANS; i++) {
+		ino = disk_sb->orphans[i];
+		if (!ino)
+			continue;
+
+		inode = ouichefs_iget(sb, ino);
+		if (IS_ERR(inode) || inode->i_nlink || !inode->i_mode) {
+			ouichefs_orphan_set(bh, i, 0);
+			if (!IS_ERR(inode))
+				iput(inode);
+			continue;
+		}
+
+		/* Destroyed by ouichefs_evict_inode() */
+		OUICHEFS_INODE(inode)->i_orphan = i;
+		iput(inode);
+		nr++;
+	}
+	brelse(bh);
+
+	if (nr)
+		pr_info("reclaimed %u orphan inodes\n", nr);
+}
@@ -8,6 +8,9 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
@@ -36,6 +39,66 @@
  *
  */
 
+/*
+ * The superblock keeps a summary of the largest runs of free blocks known when
+ * it was last written. It is only a hint: the allocator starts looking for
+ * free blocks from there, and the bitmap has the last word.
+ */
+#define OUICHEFS_SUMMARY_RUNS 32
+
+/* Superblock state, dirty while mounted */
+#define OUICHEFS_STATE_DIRTY 0
+#define OUICHEFS_STATE_CLEAN 1
+
+struct ouichefs_free_run {
+	uint32_t start; /* First free block */
+	uint32_t len; /* Number of free blocks, 0 for an unused entry */
+};
+
+/*
+ * Inodes that have no directory entry yet and must be reclaimed after a crash
+ * (O_TMPFILE) are listed in the superblock, see orphan.c.
+ */
+#define OUICHEFS_NR_ORPHANS 128
+
+struct ouichefs_superblock {
+	uint32_t magic; /* Magic number */
+
+	uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
+	uint32_t nr_inodes; /* Total number of inodes */
+
+	uint32_t nr_istore_blocks; /* Number of inode store blocks */
+	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
+	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
+
+	uint32_t nr_free_inodes; /* Number of free inodes */
+	uint32_t nr_free_blocks; /* Number of free blocks */
+
+	uint32_t state; /* OUICHEFS_STATE_* */
+	struct ouichefs_free_run free_runs[OUICHEFS_SUMMARY_RUNS];
+
+	uint32_t inode_size; /* Size of an inode store slot, 0 for legacy */
+	uint32_t features; /* OUICHEFS_FEATURE_* */
+	uint32_t orphans[OUICHEFS_NR_ORPHANS]; /* Orphan inodes, 0 if unused */
+
+	char padding[3284]; /* Padding to match block size */
+};
+
+/*
+ * Optional on-disk format features. A partition using a feature unknown to
+ * this module is not mounted.
+ */
+#define OUICHEFS_FEATURE_INLINE_DATA 0x1 /* Tiny files stored in the inode */
+#define OUICHEFS_FEATURE_DIRECT_BLOCKS 0x2 /* Direct block pointers */
+#define OUICHEFS_FEATURE_INODE_V2 0x4 /* struct ouichefs_inode_v2 */
+#define OUICHEFS_FEATURE_HASHED_DIRS 0x8 /* struct ouichefs_dirent */
+#define OUICHEFS_FEATURE_LARGE_DIRS 0x10 /* struct ouichefs_dx_block */
+#define OUICHEFS_FEATURE_SPARSE_DIRS 0x20 /* Unpacked ouichefs_dir_block */
+#define OUICHEFS_FEATURES_SUPPORTED                                   \
+	(OUICHEFS_FEATURE_INLINE_DATA | OUICHEFS_FEATURE_DIRECT_BLOCKS | \
+	 OUICHEFS_FEATURE_INODE_V2 | OUICHEFS_FEATURE_HASHED_DIRS |      \
+	 OUICHEFS_FEATURE_LARGE_DIRS | OUICHEFS_FEATURE_SPARSE_DIRS)
+
 struct ouichefs_inode {
 	uint32_t i_mode; /* File mode */
 	uint32_t i_uid; /* Owner id */
@@ -50,15 +113,103 @@ struct ouichefs_inode {
 	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags */
 };
 
+/*
+ * Version 2 inode, 64 bytes long with every field naturally aligned. Its slots
+ * never straddle a cache line or an inode store block, and timestamps are
+ * 64-bit. Used instead of struct ouichefs_inode with OUICHEFS_FEATURE_INODE_V2,
+ * the inode size (64 or 128 bytes, see mkfs) then being a power of two.
+ */
+struct ouichefs_inode_v2 {
+	uint64_t i_ctime; /* Inode change time (sec) */
+	uint64_t i_atime; /* Access time (sec) */
+	uint64_t i_mtime; /* Modification time (sec) */
+	uint32_t i_nctime; /* Inode change time (nsec) */
+	uint32_t i_natime; /* Access time (nsec) */
+	uint32_t i_nmtime; /* Modification time (nsec) */
+	uint16_t i_mode; /* File mode */
+	uint16_t i_flags; /* OUICHEFS_INODE_* flags */
+	uint32_t i_uid; /* Owner id */
+	uint32_t i_gid; /* Group id */
+	uint32_t i_size; /* Size in bytes */
+	uint32_t i_blocks; /* Block count */
+	uint32_t i_nlink; /* Hard links count */
+	uint32_t index_block; /* Block with list of blocks for this file */
+};
+
+/*
+ * Each inode store slot is sb->inode_size bytes long. With the inline data
+ * feature, the slot is larger than the on-disk inode (sbi->inode_hdr_size
+ * bytes), and the rest of the slot can hold the content of a small regular
+ * file instead of an index block.
+ */
+#define OUICHEFS_INODE_INLINE 0x1 /* Data stored in the inode store slot */
+#define OUICHEFS_INODE_INDEXED 0x2 /* Directory index_block is a dx block */
+
+#define OUICHEFS_INLINE_DATA(sbi, disk_inode) \
+	((char *)(disk_inode) + (sbi)->inode_hdr_size)
+
+/*
+ * With the direct blocks feature, the same area holds the block numbers of the
+ * first OUICHEFS_NR_DIRECT blocks of a regular file that is not inline. The
+ * index block then lists the following blocks, and is only allocated once the
+ * file grows past them (index_block is 0 until then).
+ */
+#define OUICHEFS_NR_DIRECT 12
+
+#define OUICHEFS_INODE_DIRECT(sbi, disk_inode) \
+	((uint32_t *)OUICHEFS_INLINE_DATA(sbi, disk_inode))
+
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	uint32_t i_flags;
+	uint32_t i_direct[OUICHEFS_NR_DIRECT]; /* Direct blocks, 0 if none */
+
+	/* Name index of a directory (see namecache.c), NULL if not built */
+	struct ouichefs_ncache *i_ncache;
+	struct mutex i_ncache_lock; /* Protects i_ncache */
+	struct list_head i_ncache_lru; /* In sbi->ncache_lru while built */
+	bool i_ncache_ref; /* Used since the last shrinker scan */
+
+	struct list_head i_rmtree; /* In sbi->rmtree_list while detached */
+	int i_orphan; /* Slot in the orphan table, -1 if not listed */
+
 	struct inode vfs_inode;
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+/*
+ * The inode store is split in groups of consecutive blocks. Top-level
+ * directories are spread over groups, other inodes are allocated next to their
+ * parent directory.
+ */
+#define OUICHEFS_IGROUP_BLOCKS 8
+#define OUICHEFS_INODES_PER_GROUP(sbi) \
+	((sbi)->inodes_per_block * OUICHEFS_IGROUP_BLOCKS)
+
+/* How freed data blocks are erased (scrub= mount option) */
+enum ouichefs_scrub_policy {
+	OUICHEFS_SCRUB_NONE, /* leave the old content on disk */
+	OUICHEFS_SCRUB_DISCARD, /* blkdev_issue_discard() */
+	OUICHEFS_SCRUB_ZEROOUT, /* blkdev_issue_zeroout() */
+	OUICHEFS_SCRUB_BUFFERED, /* zero through the buffer cache (default) */
+};
+
+#define OUICHEFS_BITS_PER_BLOCK (OUICHEFS_BLOCK_SIZE * 8)
+
+/* On-disk bitmap, loaded block by block in the buffer cache */
+struct ouichefs_bitmap {
+	struct buffer_head **bh; /* Pinned bitmap blocks, NULL if not loaded */
+	unsigned long *full; /* Blocks known to have no free bit */
+	unsigned long nr_loaded; /* Number of pinned blocks */
+	struct super_block *sb;
+	uint32_t first; /* First block of the bitmap on disk */
+	uint32_t nr_blocks; /* Number of blocks */
+	unsigned long nr_bits; /* Number of meaningful bits */
+	/* Free bits not to hand out, [busy_start, busy_end), e.g. being trimmed */
+	unsigned long busy_start, busy_end;
+};
 
 struct ouichefs_sb_info {
 	uint32_t magic; /* Magic number */
@@ -73,14 +224,60 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	uint32_t inode_size; /* Size of an inode store slot */
+	uint32_t inode_hdr_size; /* Size of the on-disk inode in a slot */
+	uint32_t inodes_per_block; /* Number of inodes per inode store block */
+	uint32_t features; /* OUICHEFS_FEATURE_* */
+	uint32_t inline_size; /* Max size of inline files, 0 if disabled */
+	uint32_t nr_direct; /* Direct blocks per inode, 0 if disabled */
+	uint32_t name_len; /* Max length of a file name */
+
+	struct ouichefs_bitmap ifree_bitmap; /* Free inodes bitmap */
+	struct ouichefs_bitmap bfree_bitmap; /* Free blocks bitmap */
+	struct mutex bitmap_lock; /* Protects both bitmaps and free counters */
+	struct shrinker bitmap_shrinker; /* Unpins clean bitmap blocks */
+	struct mutex orphan_lock; /* Protects the orphan table */
+	struct mutex trim_lock; /* Serializes FITRIM, see ouichefs_trim_fs() */
+
+	/* Directory name indexes, coldest last */
+	struct list_head ncache_lru;
+	spinlock_t ncache_lock; /* Protects ncache_lru */
+	atomic_long_t ncache_nr; /* Number of indexed entries */
+	struct shrinker ncache_shrinker; /* Drops cold name indexes */
+
+	uint32_t state; /* OUICHEFS_STATE_* written with the superblock */
+	/* Largest known free runs, protected by bitmap_lock */
+	struct ouichefs_free_run free_runs[OUICHEFS_SUMMARY_RUNS];
+	struct work_struct summary_work; /* Rebuilds free_runs after a crash */
+	bool summary_valid; /* free_runs covers the whole bitmap */
+	bool summary_stop; /* Set at unmount to stop summary_work */
+
+	int scrub; /* enum ouichefs_scrub_policy */
+	bool discard; /* Discard freed blocks (discard mount option) */
+
+	struct super_block *sb; /* Back pointer, for workers */
+	struct workqueue_struct *free_wq; /* Deferred block freeing */
+	struct work_struct free_work;
+	spinlock_t free_lock; /* Protects free_list */
+	struct list_head free_list; /* Index blocks waiting to be freed */
+
+	/* Directories removed by OUICHEFS_IOC_RMTREE, see rmtree.c */
+	struct workqueue_struct *rmtree_wq;
+	struct work_struct rmtree_work;
+	spinlock_t rmtree_lock; /* Protects rmtree_list */
+	struct list_head rmtree_list; /* Detached directories to reclaim */
+	struct ouichefs_rmtree_batch *rmtree_batch; /* Used by rmtree_work */
 };
 
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+/*
+ * Entries of a directory block are packed at its beginning. With the sparse
+ * directories feature, a removed entry is only cleared (inode 0), and free
+ * entries may be anywhere in the block.
+ */
 struct ouichefs_dir_block {
 	struct ouichefs_file {
 		uint32_t inode;
@@ -88,13 +285,221 @@ struct ouichefs_dir_block {
 	} files[OUICHEFS_MAX_SUBFILES];
 };
 
+/*
+ * Directory block with the hashed directories feature: a chain of variable
+ * length records covering the whole block. Each record carries the hash of its
+ * name (see ouichefs_name_hash()), so that a lookup only compares the names of
+ * the entries with the same hash. A free record has inode 0: removing an entry
+ * only clears its inode. A new entry takes a free record, or the room left at
+ * the end of a used one, free records being merged with the record before them
+ * on the way.
+ */
+#define OUICHEFS_NAME_LEN 255
+
+struct ouichefs_dirent {
+	uint32_t inode;
+	uint32_t hash; /* ouichefs_name_hash() of name */
+	uint16_t rec_len; /* Distance to the next record */
+	uint8_t name_len;
+	uint8_t file_type; /* fs_umode_to_ftype() of the inode mode */
+	char name[]; /* Not NUL-terminated */
+};
+
+/* Room used by a record for a name of len bytes, records are 4-byte aligned */
+#define OUICHEFS_DIRENT_LEN(len) \
+	round_up(sizeof(struct ouichefs_dirent) + (len), 4)
+#define OUICHEFS_DIRENT_MAX (OUICHEFS_BLOCK_SIZE / OUICHEFS_DIRENT_LEN(1))
+
+/*
+ * With the large directories feature, a hashed directory whose block is full
+ * is split: its index_block becomes a dx block (OUICHEFS_INODE_INDEXED) that
+ * lists up to OUICHEFS_DX_LEAVES leaves, each a block of struct ouichefs_dirent.
+ * Leaf i holds the entries whose hash is in [leaves[i].hash,
+ * leaves[i + 1].hash), leaves[0].hash being 0.
+ */
+#define OUICHEFS_DX_LEAVES 511
+
+struct ouichefs_dx_block {
+	uint32_t nr_leaves; /* Number of leaves in use */
+	uint32_t reserved;
+	struct ouichefs_dx_entry {
+		uint32_t hash; /* Lowest hash in the leaf */
+		uint32_t block; /* Leaf block */
+	} leaves[OUICHEFS_DX_LEAVES];
+};
+
+/* FNV-1a hash of a file name, as stored in directory entries */
+static inline uint32_t ouichefs_name_hash(const unsigned char *name,
+					  unsigned int len)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= *name++;
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+/*
+ * OUICHEFS_IOC_READDIRPLUS, on a directory: fill buf with records of its
+ * entries and the attributes of their inodes, as stat() would return them.
+ * Set pos to 0 for the first call; each call returns the number of records it
+ * wrote in count (0 at the end of the directory) and advances pos past them.
+ * pos is a readdir() position: it stays valid while entries are added or
+ * removed in hashed directories.
+ */
+struct ouichefs_readdirplus {
+	uint64_t buf; /* User buffer of struct ouichefs_direntplus records */
+	uint32_t size; /* Size of buf */
+	uint32_t count; /* Number of records written (out) */
+	uint64_t pos; /* Position of the next entry (in/out) */
+};
+
+struct ouichefs_direntplus {
+	uint64_t ino;
+	uint64_t size; /* File size in bytes */
+	int64_t mtime; /* Modification time (sec) */
+	uint32_t mtime_nsec; /* Modification time (nsec) */
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	uint16_t rec_len; /* Distance to the next record */
+	uint8_t name_len;
+	uint8_t reserved;
+	char name[]; /* NUL-terminated */
+};
+
+/* Room used by a record for a name of len bytes, records are 8-byte aligned */
+#define OUICHEFS_DIRENTPLUS_LEN(len) \
+	round_up(sizeof(struct ouichefs_direntplus) + (len) + 1, 8)
+
+#define OUICHEFS_IOC_READDIRPLUS _IOWR('o', 1, struct ouichefs_readdirplus)
+
+/*
+ * OUICHEFS_IOC_BULK_CREATE and OUICHEFS_IOC_BULK_UNLINK, on a directory: create
+ * empty regular files, or unlink regular files, named after the count
+ * NUL-terminated names packed in names. Names are handled in order, and the
+ * call stops at the first one that fails, returning its error; done is the
+ * number of names handled before.
+ */
+struct ouichefs_bulk {
+	uint64_t names; /* User buffer of NUL-terminated names */
+	uint32_t size; /* Size of names, at most OUICHEFS_BULK_MAX */
+	uint32_t count; /* Number of names */
+	uint32_t mode; /* Permissions of the new files, before the umask */
+	uint32_t done; /* Number of names handled (out) */
+};
+
+#define OUICHEFS_BULK_MAX (1 << 20)
+
+#define OUICHEFS_IOC_BULK_CREATE _IOWR('o', 2, struct ouichefs_bulk)
+#define OUICHEFS_IOC_BULK_UNLINK _IOWR('o', 3, struct ouichefs_bulk)
+
+/*
+ * OUICHEFS_IOC_RMTREE, on a directory: remove its subdirectory name and all
+ * its content. The subdirectory is gone from the directory on return, its
+ * inodes and blocks are reclaimed in the background.
+ */
+struct ouichefs_rmtree {
+	uint64_t name; /* User pointer to the NUL-terminated name */
+};
+
+#define OUICHEFS_IOC_RMTREE _IOW('o', 4, struct ouichefs_rmtree)
+
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
+void ouichefs_readahead_blocks(struct super_block *sb, uint32_t first,
+			       uint32_t nr_blocks);
+int ouichefs_sync_bitmaps(struct super_block *sb);
+
+/* bitmap functions */
+int ouichefs_init_bitmap(struct super_block *sb, struct ouichefs_bitmap *bm,
+			 uint32_t first, uint32_t nr_blocks,
+			 unsigned long nr_bits);
+void ouichefs_release_bitmap(struct ouichefs_bitmap *bm);
+int ouichefs_register_bitmap_shrinker(struct super_block *sb);
+void ouichefs_unregister_bitmap_shrinker(struct super_block *sb);
+unsigned long ouichefs_bitmap_find(struct ouichefs_bitmap *bm,
+				   unsigned long start, unsigned long end,
+				   bool set);
+long ouichefs_bitmap_assign(struct ouichefs_bitmap *bm, unsigned long start,
+			    unsigned long count, bool set);
+void ouichefs_summary_refresh(struct ouichefs_sb_info *sbi, unsigned long blk);
+uint32_t ouichefs_summary_goal(struct ouichefs_sb_info *sbi);
+void ouichefs_summary_consume(struct ouichefs_sb_info *sbi, uint32_t bno);
+void ouichefs_summary_work(struct work_struct *work);
+
+/* block freeing functions */
+int ouichefs_init_free_queue(struct super_block *sb);
+void ouichefs_flush_free_queue(struct super_block *sb);
+void ouichefs_destroy_free_queue(struct super_block *sb);
+void ouichefs_queue_free(struct super_block *sb, uint32_t index_block,
+			 bool is_dir);
+void ouichefs_queue_free_blocks(struct super_block *sb, const uint32_t *blocks,
+			       int nr);
+void ouichefs_queue_free_dx(struct super_block *sb, uint32_t dx_block);
+void ouichefs_free_block(struct super_block *sb, uint32_t bno);
+int ouichefs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+/* Where a directory entry lives */
+struct ouichefs_dir_slot {
+	uint32_t ino; /* Inode of the entry */
+	uint32_t bno; /* Directory block holding the entry */
+};
+
+/* directory functions */
+int ouichefs_dir_init(struct inode *dir);
+int ouichefs_dir_scan(struct inode *dir,
+		      int (*fn)(void *data, const char *name, unsigned int len,
+				uint32_t hash,
+				const struct ouichefs_dir_slot *slot),
+		      void *data);
+int ouichefs_dir_find(struct inode *dir, const struct qstr *name,
+		      uint32_t *ino);
+int ouichefs_dir_add(struct inode *dir, const struct qstr *name,
+		     struct inode *inode);
+int ouichefs_dir_remove(struct inode *dir, const struct qstr *name);
+int ouichefs_dir_empty(struct inode *dir);
+int ouichefs_iterate(struct file *dir, struct dir_context *ctx);
+
+/* directory name index functions */
+bool ouichefs_ncache_find(struct inode *dir, const struct qstr *name,
+			  uint32_t hash, struct ouichefs_dir_slot *slot);
+void ouichefs_ncache_add(struct inode *dir, const struct qstr *name,
+			 uint32_t hash, const struct ouichefs_dir_slot *slot);
+void ouichefs_ncache_remove(struct inode *dir, const struct qstr *name,
+			    uint32_t hash);
+void ouichefs_ncache_move(struct inode *dir, const char *name,
+			  unsigned int len, uint32_t hash, uint32_t bno);
+void ouichefs_ncache_drop(struct inode *dir);
+int ouichefs_register_ncache_shrinker(struct super_block *sb);
+void ouichefs_unregister_ncache_shrinker(struct super_block *sb);
 
 /* inode functions */
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
+int ouichefs_bulk_create(struct file *file, const char *names, size_t size,
+			 unsigned int count, umode_t mode, unsigned int *done);
+int ouichefs_bulk_unlink(struct file *file, const char *names, size_t size,
+			 unsigned int count, unsigned int *done);
+void ouichefs_release_inode(struct inode *inode);
+
+/* orphan functions */
+int ouichefs_orphan_add(struct inode *inode);
+void ouichefs_orphan_del(struct inode *inode);
+void ouichefs_orphan_recover(struct super_block *sb);
+
+/* recursive removal functions */
+int ouichefs_init_rmtree(struct super_block *sb);
+void ouichefs_destroy_rmtree(struct super_block *sb);
+int ouichefs_rmtree(struct file *file, const char *name);
+
+/* ioctl functions */
+long ouichefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 /* file functions */
 extern const struct file_operations ouichefs_file_ops;
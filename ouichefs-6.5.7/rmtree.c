@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/namei.h>
+#include <linux/fsnotify.h>
+#include <linux/security.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "ouichefs.h"
+
+/*
+ * Recursive removal of a directory (OUICHEFS_IOC_RMTREE). The directory is
+ * removed from its parent at once, as rmdir() would do if it were empty, and
+ * its content is reclaimed in the background by a worker. The worker empties
+ * the detached directories one at a time, OUICHEFS_RMTREE_BATCH entries per
+ * lock of the directory: regular files are destroyed as by unlink(), and
+ * subdirectories are detached in turn and queued. A directory is destroyed
+ * once it is empty. After each batch, the worker waits for the free queue, so
+ * that the reclaim goes at the pace of block freeing instead of flooding it.
+ *
+ * Detached directories are listed in sbi->rmtree_list, most recent first, each
+ * holding a reference to its inode. They are only tracked in memory: after a
+ * crash, what was not reclaimed yet stays allocated.
+ */
+#define OUICHEFS_RMTREE_BATCH 64
+
+struct ouichefs_rmtree_batch {
+	unsigned int nr;
+	struct ouichefs_rmtree_ent {
+		uint32_t ino;
+		uint8_t len;
+		char name[OUICHEFS_NAME_LEN];
+	} ents[OUICHEFS_RMTREE_BATCH];
+};
+
+static int ouichefs_rmtree_collect(void *data, const char *name,
+				   unsigned int len, uint32_t hash,
+				   const struct ouichefs_dir_slot *slot)
+{
+	struct ouichefs_rmtree_batch *b = data;
+	struct ouichefs_rmtree_ent *ent;
+
+	if (b->nr == OUICHEFS_RMTREE_BATCH)
+		return 1;
+
+	ent = &b->ents[b->nr++];
+	ent->ino = slot->ino;
+	ent->len = len;
+	memcpy(ent->name, name, len);
+
+	return 0;
+}
+
+/* Queue dir, detached from the tree, for reclaim, with a reference to it */
+static void ouichefs_rmtree_queue(struct inode *dir)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+
+	spin_lock(&sbi->rmtree_lock);
+	list_add(&OUICHEFS_INODE(dir)->i_rmtree, &sbi->rmtree_list);
+	spin_unlock(&sbi->rmtree_lock);
+
+	queue_work(sbi->rmtree_wq, &sbi->rmtree_work);
+}
+
+/*
+ * Unhash the dentry of inode, if it has one, so that nobody finds it by name.
+ * Mounts below it are detached.
+ */
+static void ouichefs_rmtree_forget(struct inode *inode)
+{
+	struct dentry *alias;
+
+	alias = d_find_alias(inode);
+	if (alias) {
+		d_invalidate(alias);
+		dput(alias);
+	}
+}
+
+/*
+ * Remove a batch of entries from the detached directory dir. Return true once
+ * dir is empty and destroyed, or if we gave up on it.
+ */
+static bool ouichefs_rmtree_dir(struct inode *dir,
+				struct ouichefs_rmtree_batch *b)
+{
+	struct ouichefs_rmtree_ent *ent;
+	struct inode *inode;
+	unsigned int i;
+	int ret;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	b->nr = 0;
+	ret = ouichefs_dir_scan(dir, ouichefs_rmtree_collect, b);
+	if (ret < 0)
+		goto fail;
+
+	if (!b->nr) {
+		/* Keep processes still in dir from creating entries in it */
+		dir->i_flags |= S_DEAD;
+		ouichefs_release_inode(dir);
+		inode_unlock(dir);
+		return true;
+	}
+
+	for (i = 0; i < b->nr; i++) {
+		struct qstr name = QSTR_INIT(b->ents[i].name, b->ents[i].len);
+
+		ent = &b->ents[i];
+		ret = ouichefs_dir_remove(dir, &name);
+		if (ret)
+			goto fail;
+
+		inode = ouichefs_iget(dir->i_sb, ent->ino);
+		if (IS_ERR(inode)) {
+			pr_err("unable to read inode %u, leaking it (%ld)\n",
+			       ent->ino, PTR_ERR(inode));
+			continue;
+		}
+		ouichefs_rmtree_forget(inode);
+
+		if (S_ISDIR(inode->i_mode)) {
+			inode_dec_link_count(dir);
+			ouichefs_rmtree_queue(inode);
+			continue;
+		}
+		inode_lock(inode);
+		ouichefs_release_inode(inode);
+		inode_unlock(inode);
+		iput(inode);
+	}
+	inode_unlock(dir);
+
+	return false;
+
+fail:
+	pr_err("unable to empty directory %lu, leaking it (%d)\n", dir->i_ino,
+	       ret);
+	dir->i_flags |= S_DEAD;
+	inode_unlock(dir);
+
+	return true;
+}
+
+static void ouichefs_rmtree_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, rmtree_work);
+	struct ouichefs_inode_info *ci;
+
+	for (;;) {
+		/* Only this worker takes directories off the list */
+		spin_lock(&sbi->rmtree_lock);
+		ci = list_first_entry_or_null(&sbi->rmtree_list,
+					      struct ouichefs_inode_info,
+					      i_rmtree);
+		spin_unlock(&sbi->rmtree_lock);
+		if (!ci)
+			break;
+
+		if (ouichefs_rmtree_dir(&ci->vfs_inode, sbi->rmtree_batch)) {
+			spin_lock(&sbi->rmtree_lock);
+			list_del_init(&ci->i_rmtree);
+			spin_unlock(&sbi->rmtree_lock);
+			iput(&ci->vfs_inode);
+		}
+
+		ouichefs_flush_free_queue(sbi->sb);
+		cond_resched();
+	}
+}
+
+/*
+ * Detach directory name from the directory of file, and queue it for reclaim.
+ * The checks are those of rmdir(), except that name does not need to be empty.
+ */
+int ouichefs_rmtree(struct file *file, const char *name)
+{
+	struct mnt_idmap *idmap = file_mnt_idmap(file);
+	struct dentry *parent = file->f_path.dentry;
+	struct inode *dir = d_inode(parent);
+	struct dentry *dentry;
+	struct inode *inode;
+	int ret;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	if (IS_DEADDIR(dir)) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+	ret = inode_permission(idmap, dir, MAY_WRITE | MAY_EXEC);
+	if (ret)
+		goto unlock;
+
+	dentry = lookup_one(idmap, name, parent, strlen(name));
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto unlock;
+	}
+	inode = d_inode(dentry);
+	if (d_really_is_negative(dentry))
+		ret = -ENOENT;
+	else if (!d_is_dir(dentry))
+		ret = -ENOTDIR;
+	else if (check_sticky(idmap, dir, inode) || IS_APPEND(dir) ||
+		 IS_APPEND(inode) || IS_IMMUTABLE(inode))
+		ret = -EPERM;
+	else if (d_mountpoint(dentry))
+		ret = -EBUSY;
+	else
+		ret = security_inode_rmdir(dir, dentry);
+	if (ret)
+		goto put;
+
+	inode_lock(inode);
+	ret = ouichefs_dir_remove(dir, &dentry->d_name);
+	inode_unlock(inode);
+	if (ret)
+		goto put;
+
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	inode_dec_link_count(dir);
+
+	d_invalidate(dentry);
+	fsnotify_rmdir(dir, dentry);
+	ihold(inode);
+	ouichefs_rmtree_queue(inode);
+
+put:
+	dput(dentry);
+unlock:
+	inode_unlock(dir);
+
+	return ret;
+}
+
+int ouichefs_init_rmtree(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	spin_lock_init(&sbi->rmtree_lock);
+	INIT_LIST_HEAD(&sbi->rmtree_list);
+	INIT_WORK(&sbi->rmtree_work, ouichefs_rmtree_work);
+
+	sbi->rmtree_batch = kmalloc(sizeof(*sbi->rmtree_batch), GFP_KERNEL);
+	if (!sbi->rmtree_batch)
+		return -ENOMEM;
+	sbi->rmtree_wq = alloc_workqueue("ouichefs-rmtree/%s", WQ_UNBOUND, 1,
+					 sb->s_id);
+	if (!sbi->rmtree_wq) {
+		kfree(sbi->rmtree_batch);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until all the detached directories are reclaimed, and stop the worker.
+ */
+void ouichefs_destroy_rmtree(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	destroy_workqueue(sbi->rmtree_wq);
+	kfree(sbi->rmtree_batch);
+}
@@ -12,6 +12,10 @@
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 #include "ouichefs.h"
 
@@ -40,6 +44,12 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	ci = kmem_cache_alloc(ouichefs_inode_cache, GFP_KERNEL);
 	if (!ci)
 		return NULL;
+	ci->i_ncache = NULL;
+	mutex_init(&ci->i_ncache_lock);
+	INIT_LIST_HEAD(&ci->i_ncache_lru);
+	ci->i_ncache_ref = false;
+	INIT_LIST_HEAD(&ci->i_rmtree);
+	ci->i_orphan = -1;
 	inode_init_once(&ci->vfs_inode);
 	return &ci->vfs_inode;
 }
@@ -49,29 +59,17 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	ouichefs_ncache_drop(inode);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
-static int ouichefs_write_inode(struct inode *inode,
-				struct writeback_control *wbc)
+/*
+ * Copy inode to its legacy on-disk version disk_inode.
+ */
+static void ouichefs_fill_disk_inode(struct ouichefs_inode *disk_inode,
+				     struct inode *inode)
 {
-	struct ouichefs_inode *disk_inode;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	uint32_t ino = inode->i_ino;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
-
-	if (ino >= sbi->nr_inodes)
-		return 0;
-
-	bh = sb_bread(sb, inode_block);
-	if (!bh)
-		return -EIO;
-	disk_inode = (struct ouichefs_inode *)bh->b_data;
-	disk_inode += inode_shift;
 
 	/* update the mode using what the generic inode has */
 	disk_inode->i_mode = inode->i_mode;
@@ -87,25 +85,146 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_blocks = inode->i_blocks;
 	disk_inode->i_nlink = inode->i_nlink;
 	disk_inode->index_block = ci->index_block;
+	disk_inode->i_flags = ci->i_flags;
+}
+
+/*
+ * Copy inode to its version 2 on-disk version disk_inode.
+ */
+static void ouichefs_fill_disk_inode_v2(struct ouichefs_inode_v2 *disk_inode,
+					struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	disk_inode->i_ctime = cpu_to_le64(inode->i_ctime.tv_sec);
+	disk_inode->i_atime = cpu_to_le64(inode->i_atime.tv_sec);
+	disk_inode->i_mtime = cpu_to_le64(inode->i_mtime.tv_sec);
+	disk_inode->i_nctime = cpu_to_le32(inode->i_ctime.tv_nsec);
+	disk_inode->i_natime = cpu_to_le32(inode->i_atime.tv_nsec);
+	disk_inode->i_nmtime = cpu_to_le32(inode->i_mtime.tv_nsec);
+	disk_inode->i_mode = cpu_to_le16(inode->i_mode);
+	disk_inode->i_flags = cpu_to_le16(ci->i_flags);
+	disk_inode->i_uid = cpu_to_le32(i_uid_read(inode));
+	disk_inode->i_gid = cpu_to_le32(i_gid_read(inode));
+	disk_inode->i_size = cpu_to_le32(inode->i_size);
+	disk_inode->i_blocks = cpu_to_le32(inode->i_blocks);
+	disk_inode->i_nlink = cpu_to_le32(inode->i_nlink);
+	disk_inode->index_block = cpu_to_le32(ci->index_block);
+}
+
+/*
+ * Copy inode to the inode store, and write it back at once if wait is set.
+ */
+static int ouichefs_write_disk_inode(struct inode *inode, bool wait)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t ino = inode->i_ino;
+	uint32_t inode_block = (ino / sbi->inodes_per_block) + 1;
+	uint32_t inode_shift = ino % sbi->inodes_per_block;
+	char *disk_inode;
+	int ret = 0;
+
+	if (ino >= sbi->nr_inodes)
+		return 0;
+
+	bh = sb_bread(sb, inode_block);
+	if (!bh)
+		return -EIO;
+	disk_inode = bh->b_data + inode_shift * sbi->inode_size;
+
+	if (sbi->features & OUICHEFS_FEATURE_INODE_V2)
+		ouichefs_fill_disk_inode_v2(
+			(struct ouichefs_inode_v2 *)disk_inode, inode);
+	else
+		ouichefs_fill_disk_inode((struct ouichefs_inode *)disk_inode,
+					 inode);
+	/* The direct blocks area of an inline file holds its data */
+	if (sbi->nr_direct && !(ci->i_flags & OUICHEFS_INODE_INLINE))
+		memcpy(OUICHEFS_INODE_DIRECT(sbi, disk_inode), ci->i_direct,
+		       sizeof(ci->i_direct));
 
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	if (wait) {
+		sync_dirty_buffer(bh);
+		if (buffer_write_io_error(bh))
+			ret = -EIO;
+	}
 	brelse(bh);
 
-	return 0;
+	return ret;
+}
+
+static int ouichefs_write_inode(struct inode *inode,
+				struct writeback_control *wbc)
+{
+	/*
+	 * Only wait for data integrity writeback. Otherwise, leave the inode
+	 * store block dirty so that the flusher writes it once for all the
+	 * inodes it holds.
+	 */
+	return ouichefs_write_disk_inode(inode,
+					 wbc->sync_mode == WB_SYNC_ALL);
+}
+
+/*
+ * Destroy an orphan inode (see orphan.c) along with its last reference. The
+ * inode is freed and written back cleared, since mark_inode_dirty() does not
+ * apply to an inode being evicted, before it leaves the orphan table.
+ */
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	invalidate_inode_buffers(inode);
+	if (!inode->i_nlink && OUICHEFS_INODE(inode)->i_orphan >= 0) {
+		ouichefs_release_inode(inode);
+		if (ouichefs_write_disk_inode(inode, true))
+			pr_err("unable to write inode %lu\n", inode->i_ino);
+		ouichefs_orphan_del(inode);
+	}
+	clear_inode(inode);
+}
+
+/*
+ * Start writing bh back. If bhs is given, bh is stored there so that the caller
+ * can wait for all the writes at once. Otherwise, bh is released here, after
+ * waiting for the write if wait is set.
+ */
+static int write_buffer(struct buffer_head *bh, struct buffer_head **bhs,
+			unsigned int *nr, int wait)
+{
+	int ret = 0;
+
+	write_dirty_buffer(bh, 0);
+	if (bhs) {
+		bhs[(*nr)++] = bh;
+		return 0;
+	}
+
+	if (wait) {
+		wait_on_buffer(bh);
+		if (buffer_write_io_error(bh))
+			ret = -EIO;
+	}
+	brelse(bh);
+
+	return ret;
 }
 
-static int sync_sb_info(struct super_block *sb, int wait)
+static int sync_sb_info(struct super_block *sb, struct buffer_head **bhs,
+			unsigned int *nr, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_sb_info *disk_sb;
+	struct ouichefs_superblock *disk_sb;
 	struct buffer_head *bh;
 
 	/* Flush superblock */
 	bh = sb_bread(sb, 0);
 	if (!bh)
 		return -EIO;
-	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
+	disk_sb = (struct ouichefs_superblock *)bh->b_data;
 
 	disk_sb->nr_blocks = sbi->nr_blocks;
 	disk_sb->nr_inodes = sbi->nr_inodes;
@@ -114,67 +233,66 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
 	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
 	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+	disk_sb->state = sbi->state;
 
+	lock_buffer(bh);
+	mutex_lock(&sbi->bitmap_lock);
+	memcpy(disk_sb->free_runs, sbi->free_runs, sizeof(sbi->free_runs));
+	mutex_unlock(&sbi->bitmap_lock);
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
-	if (wait)
-		sync_dirty_buffer(bh);
-	brelse(bh);
 
-	return 0;
+	return write_buffer(bh, bhs, nr, wait);
 }
 
-static int sync_ifree(struct super_block *sb, int wait)
+/*
+ * Write back the blocks of a bitmap that changed since the last sync. The
+ * bitmap is modified in place in the buffer cache, so the dirty bit of each
+ * buffer tells whether the block needs to be written. The free runs summary is
+ * refreshed from the free blocks bitmap blocks on their way out.
+ */
+static int sync_bitmap(struct super_block *sb, struct ouichefs_bitmap *bm,
+		       struct buffer_head **bhs, unsigned int *nr, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh;
-	int i, idx;
-
-	/* Flush free inodes bitmask */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
-
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < bm->nr_blocks; i++) {
+		/* Keep the shrinker from releasing bh under us */
+		mutex_lock(&sbi->bitmap_lock);
+		bh = bm->bh[i];
+		if (!bh || !buffer_dirty(bh)) {
+			mutex_unlock(&sbi->bitmap_lock);
+			continue;
+		}
+		if (bm == &sbi->bfree_bitmap)
+			ouichefs_summary_refresh(sbi, i);
+		get_bh(bh);
+		mutex_unlock(&sbi->bitmap_lock);
+
+		ret = write_buffer(bh, bhs, nr, wait);
+		if (ret)
+			return ret;
 	}
 
 	return 0;
 }
 
-static int sync_bfree(struct super_block *sb, int wait)
+/*
+ * Write back the dirty blocks of both bitmaps, and wait for them.
+ */
+int ouichefs_sync_bitmaps(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
-
-	/* Flush free blocks bitmask */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
+	int ret;
 
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
+	ret = sync_bitmap(sb, &sbi->ifree_bitmap, NULL, NULL, 1);
+	if (!ret)
+		ret = sync_bitmap(sb, &sbi->bfree_bitmap, NULL, NULL, 1);
 
-		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
-
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
-	}
-
-	return 0;
+	return ret;
 }
 
 static void ouichefs_put_super(struct super_block *sb)
@@ -182,27 +300,63 @@ static void ouichefs_put_super(struct super_block *sb)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
+		WRITE_ONCE(sbi->summary_stop, true);
+		cancel_work_sync(&sbi->summary_work);
+		ouichefs_destroy_free_queue(sb);
+
+		/* Everything was synced already, the summary can be trusted */
+		if (sbi->summary_valid)
+			sbi->state = OUICHEFS_STATE_CLEAN;
+		if (!sb_rdonly(sb) && sync_sb_info(sb, NULL, NULL, 1))
+			pr_err("unable to write the superblock\n");
+
+		ouichefs_unregister_ncache_shrinker(sb);
+		ouichefs_unregister_bitmap_shrinker(sb);
+		ouichefs_release_bitmap(&sbi->ifree_bitmap);
+		ouichefs_release_bitmap(&sbi->bfree_bitmap);
 		kfree(sbi);
 	}
 }
 
+/*
+ * Write back the dirty bitmap blocks and the superblock. All the writes are
+ * submitted under a single plug. With wait, we wait for all of them at once
+ * afterwards (or one by one if we cannot allocate room to track them).
+ */
 static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head **bhs = NULL;
+	struct blk_plug plug;
+	unsigned int nr = 0, i;
 	int ret = 0;
 
-	ret = sync_sb_info(sb, wait);
-	if (ret)
-		return ret;
-	ret = sync_ifree(sb, wait);
-	if (ret)
-		return ret;
-	ret = sync_bfree(sb, wait);
-	if (ret)
-		return ret;
+	if (wait) {
+		/* Release the blocks of unlinked files first */
+		ouichefs_flush_free_queue(sb);
+		bhs = kvmalloc_array(1 + sbi->nr_ifree_blocks +
+					     sbi->nr_bfree_blocks,
+				     sizeof(*bhs), GFP_NOFS);
+	}
 
-	return 0;
+	blk_start_plug(&plug);
+	ret = sync_bitmap(sb, &sbi->ifree_bitmap, bhs, &nr, wait);
+	if (!ret)
+		ret = sync_bitmap(sb, &sbi->bfree_bitmap, bhs, &nr, wait);
+	/* Last, so that it gets the summary refreshed by sync_bitmap() */
+	if (!ret)
+		ret = sync_sb_info(sb, bhs, &nr, wait);
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (buffer_write_io_error(bhs[i]))
+			ret = -EIO;
+		brelse(bhs[i]);
+	}
+	kvfree(bhs);
+
+	return ret;
 }
 
 static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
@@ -217,7 +371,26 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	stat->f_bavail = sbi->nr_free_blocks;
 	stat->f_files = sbi->nr_inodes;
 	stat->f_ffree = sbi->nr_free_inodes;
-	stat->f_namelen = OUICHEFS_FILENAME_LEN;
+	stat->f_namelen = sbi->name_len;
+
+	return 0;
+}
+
+static const char *const scrub_names[] = {
+	[OUICHEFS_SCRUB_NONE] = "none",
+	[OUICHEFS_SCRUB_DISCARD] = "discard",
+	[OUICHEFS_SCRUB_ZEROOUT] = "zeroout",
+	[OUICHEFS_SCRUB_BUFFERED] = "buffered",
+};
+
+static int ouichefs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(root->d_sb);
+
+	if (sbi->scrub != OUICHEFS_SCRUB_BUFFERED)
+		seq_printf(m, ",scrub=%s", scrub_names[sbi->scrub]);
+	if (sbi->discard)
+		seq_puts(m, ",discard");
 
 	return 0;
 }
@@ -227,18 +400,113 @@ static struct super_operations ouichefs_super_ops = {
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
 	.write_inode = ouichefs_write_inode,
+	.evict_inode = ouichefs_evict_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
+	.show_options = ouichefs_show_options,
 };
 
+enum {
+	Opt_scrub_none,
+	Opt_scrub_discard,
+	Opt_scrub_zeroout,
+	Opt_scrub_buffered,
+	Opt_discard,
+	Opt_nodiscard,
+	Opt_err,
+};
+
+static const match_table_t tokens = {
+	{ Opt_scrub_none, "scrub=none" },
+	{ Opt_scrub_discard, "scrub=discard" },
+	{ Opt_scrub_zeroout, "scrub=zeroout" },
+	{ Opt_scrub_buffered, "scrub=buffered" },
+	{ Opt_discard, "discard" },
+	{ Opt_nodiscard, "nodiscard" },
+	{ Opt_err, NULL },
+};
+
+/* Parse mount options into sbi */
+static int ouichefs_parse_options(struct super_block *sb, char *options)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	sbi->scrub = OUICHEFS_SCRUB_BUFFERED;
+	sbi->discard = false;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_scrub_none:
+			sbi->scrub = OUICHEFS_SCRUB_NONE;
+			break;
+		case Opt_scrub_discard:
+			sbi->scrub = OUICHEFS_SCRUB_DISCARD;
+			break;
+		case Opt_scrub_zeroout:
+			sbi->scrub = OUICHEFS_SCRUB_ZEROOUT;
+			break;
+		case Opt_scrub_buffered:
+			sbi->scrub = OUICHEFS_SCRUB_BUFFERED;
+			break;
+		case Opt_discard:
+			sbi->discard = true;
+			break;
+		case Opt_nodiscard:
+			sbi->discard = false;
+			break;
+		default:
+			pr_err("Unknown mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	if (!bdev_max_discard_sectors(sb->s_bdev)) {
+		if (sbi->scrub == OUICHEFS_SCRUB_DISCARD) {
+			pr_warn("device does not support discard, using scrub=none\n");
+			sbi->scrub = OUICHEFS_SCRUB_NONE;
+		}
+		if (sbi->discard) {
+			pr_warn("device does not support discard, ignoring discard option\n");
+			sbi->discard = false;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Start reading nr_blocks blocks from block first without waiting for them. All
+ * the reads are submitted under one plug so that they can be merged; a later
+ * sb_bread() of one of these blocks only waits for its own read to complete.
+ */
+void ouichefs_readahead_blocks(struct super_block *sb, uint32_t first,
+			       uint32_t nr_blocks)
+{
+	struct blk_plug plug;
+	uint32_t i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr_blocks; i++)
+		sb_breadahead(sb, first + i);
+	blk_finish_plug(&plug);
+}
+
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh = NULL;
-	struct ouichefs_sb_info *csb = NULL;
+	struct ouichefs_superblock *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
-	int ret = 0, i;
+	int ret = 0;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
@@ -251,7 +519,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
 	if (!bh)
 		return -EIO;
-	csb = (struct ouichefs_sb_info *)bh->b_data;
+	csb = (struct ouichefs_superblock *)bh->b_data;
 
 	/* Check magic number */
 	if (csb->magic != sb->s_magic) {
@@ -273,59 +541,108 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
 	sbi->nr_free_inodes = csb->nr_free_inodes;
 	sbi->nr_free_blocks = csb->nr_free_blocks;
-	sb->s_fs_info = sbi;
 
-	brelse(bh);
-
-	/* Alloc and copy ifree_bitmap */
-	sbi->ifree_bitmap =
-		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->ifree_bitmap) {
-		ret = -ENOMEM;
+	/* Check the inode format */
+	sbi->inode_size = csb->inode_size ? csb->inode_size :
+					    sizeof(struct ouichefs_inode);
+	sbi->features = csb->features;
+	if (sbi->features & ~OUICHEFS_FEATURES_SUPPORTED) {
+		pr_err("Unsupported features %#x\n",
+		       sbi->features & ~OUICHEFS_FEATURES_SUPPORTED);
+		ret = -EINVAL;
 		goto free_sbi;
 	}
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_ifree;
+	if (sbi->features & OUICHEFS_FEATURE_INODE_V2)
+		sbi->inode_hdr_size = sizeof(struct ouichefs_inode_v2);
+	else
+		sbi->inode_hdr_size = sizeof(struct ouichefs_inode);
+	if (sbi->inode_size < sbi->inode_hdr_size ||
+	    sbi->inode_size > OUICHEFS_BLOCK_SIZE ||
+	    ((sbi->features & OUICHEFS_FEATURE_INODE_V2) &&
+	     !is_power_of_2(sbi->inode_size))) {
+		pr_err("Invalid inode size %u\n", sbi->inode_size);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+	if ((sbi->features & OUICHEFS_FEATURE_LARGE_DIRS) &&
+	    !(sbi->features & OUICHEFS_FEATURE_HASHED_DIRS)) {
+		pr_err("Large directories require hashed directories\n");
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+	sbi->inodes_per_block = OUICHEFS_BLOCK_SIZE / sbi->inode_size;
+	if (sbi->features & OUICHEFS_FEATURE_HASHED_DIRS)
+		sbi->name_len = OUICHEFS_NAME_LEN;
+	else
+		sbi->name_len = OUICHEFS_FILENAME_LEN;
+	if (sbi->features & OUICHEFS_FEATURE_INLINE_DATA)
+		sbi->inline_size = sbi->inode_size - sbi->inode_hdr_size;
+	if (sbi->features & OUICHEFS_FEATURE_DIRECT_BLOCKS) {
+		if (sbi->inode_size < sbi->inode_hdr_size +
+					      OUICHEFS_NR_DIRECT *
+						      sizeof(uint32_t)) {
+			pr_err("Inode size %u too small for direct blocks\n",
+			       sbi->inode_size);
+			ret = -EINVAL;
+			goto free_sbi;
 		}
-
-		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
-
-		brelse(bh);
+		sbi->nr_direct = OUICHEFS_NR_DIRECT;
 	}
 
-	/* Alloc and copy bfree_bitmap */
-	sbi->bfree_bitmap =
-		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->bfree_bitmap) {
-		ret = -ENOMEM;
-		goto free_ifree;
+	/* The free runs summary is only up to date after a clean unmount */
+	if (csb->state == OUICHEFS_STATE_CLEAN) {
+		memcpy(sbi->free_runs, csb->free_runs, sizeof(sbi->free_runs));
+		sbi->summary_valid = true;
 	}
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
+	sbi->state = OUICHEFS_STATE_DIRTY;
+	INIT_WORK(&sbi->summary_work, ouichefs_summary_work);
+	mutex_init(&sbi->bitmap_lock);
+	mutex_init(&sbi->orphan_lock);
+	mutex_init(&sbi->trim_lock);
+	sbi->sb = sb;
+	sb->s_fs_info = sbi;
 
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_bfree;
-		}
+	brelse(bh);
+	bh = NULL;
 
-		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+	ret = ouichefs_parse_options(sb, data);
+	if (ret)
+		goto free_sbi;
 
-		brelse(bh);
-	}
+	ret = ouichefs_init_free_queue(sb);
+	if (ret)
+		goto free_sbi;
+	ret = ouichefs_init_rmtree(sb);
+	if (ret)
+		goto free_queue;
+
+	/*
+	 * Set up the free inodes and free blocks bitmaps. Their blocks are read
+	 * on first use, and unpinned by the shrinker when clean.
+	 */
+	ret = ouichefs_init_bitmap(sb, &sbi->ifree_bitmap,
+				   sbi->nr_istore_blocks + 1,
+				   sbi->nr_ifree_blocks, sbi->nr_inodes);
+	if (ret)
+		goto destroy_rmtree;
+	ret = ouichefs_init_bitmap(sb, &sbi->bfree_bitmap,
+				   sbi->nr_istore_blocks +
+					   sbi->nr_ifree_blocks + 1,
+				   sbi->nr_bfree_blocks, sbi->nr_blocks);
+	if (ret)
+		goto free_ifree;
+	ret = ouichefs_register_bitmap_shrinker(sb);
+	if (ret)
+		goto free_bfree;
+	ret = ouichefs_register_ncache_shrinker(sb);
+	if (ret)
+		goto unregister;
 
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto unregister_ncache;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
@@ -334,14 +651,35 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto iput;
 	}
 
+	/* Reclaim the O_TMPFILE files of a crashed system */
+	if (!sb_rdonly(sb))
+		ouichefs_orphan_recover(sb);
+
+	/*
+	 * Flag the superblock dirty until unmount, and rebuild the summary. A
+	 * read-only mount leaves the disk untouched.
+	 */
+	if (!sb_rdonly(sb) && sync_sb_info(sb, NULL, NULL, 1))
+		pr_warn("unable to write the superblock\n");
+	if (!sbi->summary_valid)
+		queue_work(system_unbound_wq, &sbi->summary_work);
+
 	return 0;
 
 iput:
 	iput(root_inode);
+unregister_ncache:
+	ouichefs_unregister_ncache_shrinker(sb);
+unregister:
+	ouichefs_unregister_bitmap_shrinker(sb);
 free_bfree:
-	kfree(sbi->bfree_bitmap);
+	ouichefs_release_bitmap(&sbi->bfree_bitmap);
 free_ifree:
-	kfree(sbi->ifree_bitmap);
+	ouichefs_release_bitmap(&sbi->ifree_bitmap);
+destroy_rmtree:
+	ouichefs_destroy_rmtree(sb);
+free_queue:
+	ouichefs_destroy_free_queue(sb);
 free_sbi:
 	kfree(sbi);
 release: